@@ -4,6 +4,8 @@
 
 #include <libgen.h>
 #include <sys/select.h>
+#include <sys/mman.h>
+#include <sys/statvfs.h>
 
 /* If this include file is missing, you need the pcre package,
  * and the pcre-devel package. */
@@ -193,6 +195,28 @@ pst fetchLine(int n, int show)
 	return fetchLineContext(n, show, context);
 }
 
+/* Searching looks at every line, and makes no changes,
+ * so the copy is just overhead.
+ * Borrow the stored text of line n, and its length without the newline,
+ * unless hidden numbers have to come out, then it is a stripped copy.
+ * Either way, hand it back with releaseLine(). */
+pst borrowLineWindow(int n, const Window *w, int *len)
+{
+	pst p;
+	if (w->browseMode)
+		p = fetchLineWindow(n, 1, w);
+	else
+		p = fetchLineWindow(n, -1, w);
+	*len = pstLength(p) - 1;
+	return p;
+}
+
+void releaseLine(pst p, int n, const Window *w)
+{
+	if (p != w->map[n].text)
+		free(p);
+}
+
 /* Display a line to the screen, with a limit on output length. */
 void displayLine(int n)
 {
@@ -422,6 +446,17 @@ nextrender is the suggested time to render again, if js changes have been made.
 It is generally 20 seconds after the last render.
 *********************************************************************/
 
+// Is there input waiting on stdin? Don't block.
+static bool inputWaiting(void)
+{
+	fd_set channels;
+	struct timeval tv;
+	memset(&channels, 0, sizeof(channels));
+	FD_SET(0, &channels);
+	tv.tv_sec = tv.tv_usec = 0;
+	return select(1, &channels, 0, 0, &tv) != 0;
+}
+
 pst inputLine(const bool textEntry)
 {
 	static char line[MAXTTYLINE];
@@ -437,6 +472,11 @@ top:
 	nzFree(last_rl), last_rl = 0;
 	s = 0;
 
+// Use the time between commands to warm up javascript contexts for the next
+// page or frame, one at a time, until the user starts typing.
+	if (isInteractive)
+		while (!inputWaiting() && jsPoolFill()) ;
+
 	if (timerWait(&delay_sec, &delay_ms)) {
 /* timers are pending, use select to wait on input or run the first timer. */
 		fd_set channels;
@@ -814,6 +854,153 @@ static void print_pst(pst p)
 			printf("\n");
 }
 
+/*********************************************************************
+Storage for the lines of text.
+Each line use to be its own malloc, and each line was freed on its own.
+Read a log file with 5 million lines and that's 5 million mallocs,
+with the text scattered all over the heap.
+Now text2linemap() carves its lines out of large chunks.
+A window fills one chunk at a time, and the chunk is recorded in
+w->linechunk; when that fills up, or when a block of text is too big
+to fit, a new chunk is started, sized for the text that is coming in.
+A chunk keeps a count of the lines within it that are still alive.
+When a line is freed, we find its chunk and decrement the count,
+and when the count reaches 0, and the window has moved on to another chunk,
+the entire chunk is freed.
+Lines are never changed in place to make them longer;
+a substitution builds a new line and frees the old one,
+so copy on write falls out naturally.
+But every free of a line must go through freeLineText(),
+which knows whether the pointer is in a chunk or is its own malloc.
+All the chunks are kept in an array, sorted by address,
+so we can find the chunk for a line by binary search.
+A large file can be mapped into memory, and then the mapped region
+is a chunk, and the lines point right into the file; see readMapped().
+*********************************************************************/
+
+#define LINECHUNK 0x10000 // smallest chunk of lines
+
+struct lineChunk {
+	Window *owner; // window still adding lines to this chunk
+	uchar *data;
+	size_t size, used;
+	int live; // lines in this chunk not yet freed
+	bool mapped; // a file mapped into memory
+};
+
+static struct lineChunk **chunkList;
+static int chunkNum, chunkMax;
+static size_t mapPage; // a mapped chunk has one page of zeros past its end
+
+// find the chunk containing p, or -1 if p is its own allocation
+static int findChunk(const uchar *p)
+{
+	int lo = 0, hi = chunkNum - 1, mid;
+	const struct lineChunk *c;
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		c = chunkList[mid];
+		if (p < c->data) {
+			hi = mid - 1;
+			continue;
+		}
+		if (p >= c->data + c->size) {
+			lo = mid + 1;
+			continue;
+		}
+		return mid;
+	}
+	return -1;
+}
+
+static struct lineChunk *newChunk(size_t size, uchar *data)
+{
+	struct lineChunk *c = allocZeroMem(sizeof(struct lineChunk));
+	int i;
+	if (data)
+		c->data = data, c->mapped = true;
+	else
+		c->data = allocMem(size);
+	c->size = size;
+	if (chunkNum == chunkMax) {
+		chunkMax = (chunkMax ? chunkMax * 2 : 16);
+		chunkList = reallocMem(chunkList, chunkMax * sizeof(struct lineChunk *));
+	}
+	for (i = chunkNum; i > 0; --i) {
+		if (chunkList[i - 1]->data < c->data)
+			break;
+		chunkList[i] = chunkList[i - 1];
+	}
+	chunkList[i] = c;
+	++chunkNum;
+	debugPrint(7, "line chunk %zu", size);
+	return c;
+}
+
+static void deleteChunk(int i)
+{
+	struct lineChunk *c = chunkList[i];
+	debugPrint(7, "free line chunk %zu", c->size);
+	--chunkNum;
+	memmove(chunkList + i, chunkList + i + 1,
+		(chunkNum - i) * sizeof(struct lineChunk *));
+	if (c->mapped)
+		munmap(c->data, c->size + mapPage);
+	else
+		free(c->data);
+	free(c);
+}
+
+// The window no longer fills this chunk; free it if nothing lives there.
+static void releaseChunk(Window *w)
+{
+	struct lineChunk *c = w->linechunk;
+	w->linechunk = 0;
+	if (!c)
+		return;
+	c->owner = 0;
+	if (!c->live)
+		deleteChunk(findChunk(c->data));
+}
+
+// room for size bytes of text in the current window's chunk
+static uchar *chunkSpace(size_t size)
+{
+	struct lineChunk *c = cw->linechunk;
+	if (!c || c->size - c->used < size) {
+		releaseChunk(cw);
+		c = newChunk(size > LINECHUNK ? size : LINECHUNK, 0);
+		c->owner = cw;
+		cw->linechunk = c;
+	}
+	return c->data + c->used;
+}
+
+// take len bytes from the current chunk, for one line
+static pst chunkLine(size_t len)
+{
+	struct lineChunk *c = cw->linechunk;
+	pst p = c->data + c->used;
+	c->used += len;
+	++c->live;
+	return p;
+}
+
+void freeLineText(pst p)
+{
+	int i;
+	struct lineChunk *c;
+	if (!p || p == (uchar *) emptyString)
+		return;
+	if (!chunkNum || (i = findChunk(p)) < 0) {
+		free(p);
+		return;
+	}
+	c = chunkList[i];
+	if (--c->live == 0 && !c->owner)
+		deleteChunk(i);
+}
+
 static void freeLine(struct lineMap *t)
 {
 	if(!t->text || t->text == (uchar*)emptyString) return;
@@ -824,7 +1011,7 @@ static void freeLine(struct lineMap *t)
 			printf("free ");
 		print_pst(t->text);
 	}
-	nzFree(t->text);
+	freeLineText(t->text);
 }
 
 void freeWindowLines(struct lineMap *map)
@@ -844,104 +1031,247 @@ void freeWindowLines(struct lineMap *map)
 }
 
 /*********************************************************************
-Garbage collection for text lines.
-There is an undo window that holds a snapshot of the buffer as it was before.
-not a copy of all the text, but a copy of map,
-and dot and dollar and some other things.
-This starts out with map = 0.
-The u command swaps undoWindow and current window (cw).
-Thus another u undoes your undo.
-You cannot step back through all your changes,
-popping a stack like a modern editor. Sorry.
-Just don't screw up more than once,
-and don't save your file til you're sure it's ok.
-No autosave feature here, I never liked that anyways.
-So at the start of every command not under g//, set madeChanges = false.
+Garbage collection for text lines, and the undo history.
+Lines are not freed as you edit the buffer; they have to stick around
+in case you undo your changes.
+At the start of every command not under g//, set madeChanges = false.
 If we're about to change something in the buffer, set madeChanges = true.
 But if madeChanges was false, i.e. this is the first change coming,
 call undoPush().
-This pushes the undo window off the cliff,
-and that means we have to free the text first.
-Call undoCompare().
-This finds any lines in the undo window that aren't in cw and frees them.
-That is a quicksort on both maps and then a comm -23.
-Then it frees undoWindow.map just to make sure we don't free things twice.
-Then undoPush copies cw onto undoWindow, ready for the u command.
-Return, and the calling function makes its change.
-But we call undoCompare at other times, like switching buffers,
+This takes a snapshot of the buffer in undoWindow,
+not a copy of all the text, but a copy of map, and dot and dollar and labels.
+Nothing more happens until the next change, or the u command,
+or something that makes undo impossible.
+Then undoCommit() compares the snapshot with the current map.
+Lines at the front and at the back that are unchanged are skipped,
+and what is left in the middle is the change.
+That piece of the old map goes into an undo step, and the snapshot is freed.
+This is one pass over the two maps, no sorting.
+The step also records the lines thrown away by the change (gone),
+and the lines brought in by the change (born).
+Moving forward through the history, a line is born once and dies once,
+so we know exactly what to free when a step goes away.
+When the oldest step falls off the end, its gone lines can't come back,
+so free them.
+If you undo, and then make a new change, the steps you could have redone
+are lost, and their born lines are freed.
+undoCompare() makes undo impossible, as when we switch buffers,
 pop the window stack, browse, or quit.
-These make undo impossible, so free the lines in the undo window.
+It drops every step, freeing gone lines behind us and born lines ahead of us.
+The u command swaps the lines in the buffer with the lines in the step,
+so a step always holds the side of the change that is not in the buffer.
+You can undo as many as undoDepth changes, set by undo=n.
+The default is 1, and then u followed by u undoes your undo,
+as it always has. redo goes forward again.
 *********************************************************************/
 
+struct undoStep {
+	int start; // first line of the change
+	int n; // lines in slice
+	int m; // lines in the buffer that slice replaces
+	struct lineMap *slice;
+	pst *gone, *born;
+	int ngone, nborn;
+	int dot;
+	int labels[MARKLETTERS];
+};
+
 static bool madeChanges;
+static bool undoPending; // snapshot in undoWindow waiting to be committed
 static Window undoWindow;
+static struct undoStep *undoList;
+static int undoNum, undoPos, undoMax;
+static int undoDepth = 1;
+static size_t mapRoom(int n);
 
-/* quick sort compare */
-static int qscmp(const void *s, const void *t)
+// A set of line pointers, open addressing, to find out what was
+// gone or born in a change.
+static pst *lineSet;
+static size_t lineSetSize;
+
+static size_t lineHash(pst p)
 {
-	return memcmp(s, t, sizeof(char *));
+	return ((size_t)p >> 4) * 2654435761u;
 }
 
-/* Free undo lines not used by the current session. */
-void undoCompare(void)
+static void lineSetBuild(const struct lineMap *map, int n)
 {
-	const struct lineMap *cmap = cw->map;
-	struct lineMap *map = undoWindow.map;
-	struct lineMap *cmap2;
-	struct lineMap *s, *t;
-	int diff, cnt = 0;
-
-	if (!cmap) {
-		debugPrint(6, "undoCompare no current map");
-		freeWindowLines(undoWindow.map);
-		undoWindow.map = 0;
-		return;
+	size_t size = 16, h;
+	int i;
+	while (size < 2 * (size_t)n)
+		size <<= 1;
+	lineSet = allocZeroMem(size * sizeof(pst));
+	lineSetSize = size;
+	for (i = 0; i < n; ++i) {
+		pst p = map[i].text;
+		h = lineHash(p) & (size - 1);
+		while (lineSet[h] && lineSet[h] != p)
+			h = (h + 1) & (size - 1);
+		lineSet[h] = p;
+	}
+}
+
+static bool lineSetHas(pst p)
+{
+	size_t h = lineHash(p) & (lineSetSize - 1);
+	while (lineSet[h]) {
+		if (lineSet[h] == p)
+			return true;
+		h = (h + 1) & (lineSetSize - 1);
 	}
+	return false;
+}
+
+// lines in map1 that are not in map2
+static pst *lineSetMinus(const struct lineMap *map1, int n1,
+const struct lineMap *map2, int n2, int *cnt)
+{
+	pst *list = allocMem(n1 * sizeof(pst));
+	int i, j = 0;
+	lineSetBuild(map2, n2);
+	for (i = 0; i < n1; ++i)
+		if (!lineSetHas(map1[i].text))
+			list[j++] = map1[i].text;
+	free(lineSet), lineSet = 0;
+	*cnt = j;
+	return list;
+}
+
+static void freeStep(struct undoStep *u, bool gone, bool born)
+{
+	int i;
+	if (gone)
+		for (i = 0; i < u->ngone; ++i)
+			freeLineText(u->gone[i]);
+	if (born)
+		for (i = 0; i < u->nborn; ++i)
+			freeLineText(u->born[i]);
+	nzFree(u->slice);
+	nzFree(u->gone);
+	nzFree(u->born);
+}
 
-	if (!map) {
-		debugPrint(6, "undoCompare no undo map");
+// Turn the snapshot into an undo step.
+static void undoCommit(void)
+{
+	Window *uw = &undoWindow;
+	const struct lineMap *before = uw->map, *after = cw->map;
+	int olddol = uw->dol, dol = cw->dol;
+	int front = 0, back = 0;
+	struct undoStep *u;
+
+	if (!undoPending)
 		return;
+	undoPending = false;
+
+	while (front < olddol && front < dol &&
+	       before[front + 1].text == after[front + 1].text)
+		++front;
+	while (back < olddol - front && back < dol - front &&
+	       before[olddol - back].text == after[dol - back].text)
+		++back;
+
+// the steps you could have redone are lost
+	while (undoNum > undoPos)
+		freeStep(undoList + --undoNum, false, true);
+
+	if (undoNum == undoMax) {
+		undoMax = undoMax * 2 + 4;
+		undoList = reallocMem(undoList, undoMax * sizeof(struct undoStep));
+	}
+	u = undoList + undoNum;
+	undoPos = ++undoNum;
+	u->start = front + 1;
+	u->n = olddol - back - front;
+	u->m = dol - back - front;
+	u->slice = allocMem(u->n * LMSIZE);
+	memcpy(u->slice, before + u->start, u->n * LMSIZE);
+	u->gone = lineSetMinus(before + u->start, u->n,
+			       after + u->start, u->m, &u->ngone);
+	u->born = lineSetMinus(after + u->start, u->m,
+			       before + u->start, u->n, &u->nborn);
+	u->dot = uw->dot;
+	memcpy(u->labels, uw->labels, MARKLETTERS * sizeof(int));
+	nzFree(uw->map);
+	uw->map = 0;
+	debugPrint(6, "undo step %d %d %d", u->start, u->n, u->m);
+
+// the oldest step falls off the end
+	while (undoNum > undoDepth) {
+		freeStep(undoList, true, false);
+		--undoNum, --undoPos;
+		memmove(undoList, undoList + 1, undoNum * sizeof(struct undoStep));
 	}
+}
 
-/* sort both arrays, run comm, and find out which lines are not needed any more,
-then free them.
- * Use quick sort; some files are a million lines long.
- * I have to copy the second array, so I can sort it.
- * The first I can sort in place, cause it's going to get thrown away. */
-
-	cmap2 = allocMem((cw->dol + 2) * LMSIZE);
-	memcpy(cmap2, cmap, (cw->dol + 2) * LMSIZE);
-	debugPrint(8, "qsort %d %d", undoWindow.dol, cw->dol);
-	qsort(map + 1, undoWindow.dol, LMSIZE, qscmp);
-	qsort(cmap2 + 1, cw->dol, LMSIZE, qscmp);
-
-	s = map + 1;
-	t = cmap2 + 1;
-	while (s->text && t->text) {
-		diff = memcmp(s, t, sizeof(char *));
-		if (!diff) {
-			++s, ++t;
-			continue;
-		}
-		if (diff > 0) {
-			++t;
-			continue;
+/* Free undo lines not used by the current session. */
+void undoCompare(void)
+{
+	int i, cnt = 0;
+	undoCommit();
+	for (i = 0; i < undoNum; ++i) {
+		struct undoStep *u = undoList + i;
+		cnt += (i < undoPos ? u->ngone : u->nborn);
+		freeStep(u, i < undoPos, i >= undoPos);
+	}
+	undoNum = undoPos = 0;
+	debugPrint(6, "undoCompare strip %d", cnt);
+}
+
+// swap the lines of the buffer with the lines in an undo step
+static void undoSwap(struct undoStep *u)
+{
+	struct lineMap *hold;
+	int newdol = cw->dol - u->m + u->n;
+	int i, j;
+
+	hold = allocMem(u->m * LMSIZE);
+	memcpy(hold, cw->map + u->start, u->m * LMSIZE);
+	if (newdol) {
+		if (cw->map) {
+			cw->map = reallocMem(cw->map, mapRoom(newdol + 2) * LMSIZE);
+		} else {
+			cw->map = allocMem(mapRoom(newdol + 2) * LMSIZE);
+			memset(cw->map, 0, 2 * LMSIZE);
 		}
-		freeLine(s);
-		++s;
-		++cnt;
+		memmove(cw->map + u->start + u->n, cw->map + u->start + u->m,
+			(cw->dol - u->start - u->m + 2) * LMSIZE);
+		memcpy(cw->map + u->start, u->slice, u->n * LMSIZE);
+	} else {
+// by convention an empty buffer has no map
+		free(cw->map);
+		cw->map = 0;
 	}
-
-	while (s->text) {
-		freeLine(s);
-		++s;
-		++cnt;
+	cw->dol = newdol;
+	nzFree(u->slice);
+	u->slice = hold;
+	i = u->n, u->n = u->m, u->m = i;
+	i = u->dot, u->dot = cw->dot, cw->dot = i;
+	for (j = 0; j < MARKLETTERS; ++j) {
+		i = u->labels[j], u->labels[j] =
+		    cw->labels[j], cw->labels[j] = i;
 	}
+}
 
-	free(cmap2);
-	free(map);
-	undoWindow.map = 0;
-	debugPrint(6, "undoCompare strip %d", cnt);
+// the u command, or redo
+static bool undoRedo(bool redo)
+{
+	if (!cw->undoable) {
+		setError(MSG_NoUndo);
+		return false;
+	}
+	undoCommit();
+	if (!redo && undoPos) {
+		undoSwap(undoList + --undoPos);
+		return true;
+	}
+// with just one level of undo, u undoes your undo
+	if (undoPos < undoNum && (redo || undoDepth == 1)) {
+		undoSwap(undoList + undoPos++);
+		return true;
+	}
+	setError(redo ? MSG_NoRedo : MSG_NoUndo);
+	return false;
 }
 
 static void undoPush(void)
@@ -958,10 +1288,14 @@ static void undoPush(void)
 	madeChanges = true;
 	debugPrint(6, "undoPush");
 
-	cw->undoable = true;
 	if (!cw->quitMode)  cw->changeMode = true;
 
-	undoCompare();
+// a change after undo was made impossible starts a new history
+	if (!cw->undoable)
+		undoCompare();
+	else
+		undoCommit();
+	cw->undoable = true;
 
 	uw = &undoWindow;
 	uw->dot = cw->dot;
@@ -975,6 +1309,7 @@ static void undoPush(void)
 		uw->map = allocMem((cw->dol + 2) * LMSIZE);
 		memcpy(uw->map, cw->map, (cw->dol + 2) * LMSIZE);
 	}
+	undoPending = true;
 }
 
 static void freeWindow(Window *w)
@@ -986,6 +1321,7 @@ static void freeWindow(Window *w)
 		fnext = f->next;
 		delTimers(f);
 		freeJSContext(f);
+		preloadDrop(f);
 		nzFree(f->dw), f->dw = 0;
 		nzFree(f->hbase), f->hbase = 0;
 		nzFree(f->fileName), f->fileName = 0;
@@ -1000,6 +1336,7 @@ static void freeWindow(Window *w)
 	}
 	freeWindowLines(w->map);
 	freeWindowLines(w->r_map);
+	releaseChunk(w);
 	nzFree(w->dmap);
 	nzFree(w->htmltitle);
 	nzFree(w->htmlauthor);
@@ -1197,6 +1534,26 @@ void cxSwitch(int cx, bool interactive)
 
 static struct lineMap *newpiece;
 
+/*********************************************************************
+We use to build a new map on every insert, and copy the old map into it,
+so reading or appending lines one at a time was quadratic.
+Now the map grows in place, and only the lines after the insertion point
+slide down; appending at the end slides nothing.
+The array is reallocated to a power of 2, so the realloc does nothing
+until we cross the next power of 2.
+Many other routines build or replace the map, in all sorts of ways,
+so we don't keep track of its capacity; realloc knows what it has.
+The same goes for gflag, and for r_map in irc mode.
+*********************************************************************/
+
+static size_t mapRoom(int n)
+{
+	size_t cap = 16;
+	while (cap < (size_t)n)
+		cap <<= 1;
+	return cap;
+}
+
 /* Adjust the map of line numbers -- we have inserted text.
  * Also shift the downstream labels.
  * Pass the string containing the new line numbers, and the dest line number. */
@@ -1204,9 +1561,9 @@ static int *nextLabel(int *label);
 void addToMap(int nlines, int destl)
 {
 	struct lineMap *newmap;
-	bool *newg;
 	int svdol = cw->dol;
 	int *label = NULL;
+	size_t room;
 
 	if (nlines == 0)
 		i_printfExit(MSG_EmptyPiece);
@@ -1228,54 +1585,47 @@ void addToMap(int nlines, int destl)
 		cw->dot = destl + nlines;
 	else if(!cw->dot) cw->dot = 1;
 
-	newmap = allocMem((cw->dol + 2) * LMSIZE);
-	if (destl)
-		memcpy(newmap, cw->map, (destl + 1) * LMSIZE);
-	else
-		memset(newmap, 0, LMSIZE);
+	room = mapRoom(cw->dol + 2);
+	if (cw->map) {
+		cw->map = reallocMem(cw->map, room * LMSIZE);
+// slide the last piece down, along with the null terminator
+		memmove(cw->map + destl + nlines + 1, cw->map + destl + 1,
+			(svdol - destl + 1) * LMSIZE);
+	} else {
+		cw->map = allocMem(room * LMSIZE);
+		memset(cw->map, 0, LMSIZE);
+		memset(cw->map + nlines + 1, 0, LMSIZE);
+	}
 // insert new piece here
-	memcpy(newmap + destl + 1, newpiece, nlines * LMSIZE);
-// put on the last piece
-	if (destl < svdol)
-		memcpy(newmap + destl + nlines + 1, cw->map + destl + 1,
-		       (svdol - destl + 1) * LMSIZE);
-	else
-		memset(newmap + destl + nlines + 1, 0, LMSIZE);
-	nzFree(cw->map);
-	cw->map = newmap;
+	memcpy(cw->map + destl + 1, newpiece, nlines * LMSIZE);
 	free(newpiece);
 	newpiece = 0;
 
 	if(cw->ircoMode1) {
 // capture the time stamp of the added lines in irc mode.
-// This isn't very space efficient, but an irc buffer isn't going to get very large.
 		int i;
 		time_t t;
 		const char *timestring;
 		time(&t);
 		timestring = conciseTime(t);
 // this is just like what we did above with map
-		newmap = allocZeroMem((cw->dol + 2) * LMSIZE);
-		if (destl) {
-// part that was already there
-			if(cw->r_map) {
-				memcpy(newmap, cw->r_map, (destl + 1) * LMSIZE);
-			} else {
-				for(i = 1; i <= destl; ++i)
-					newmap[i].text = (uchar*)emptyString;
-			}
+		if(cw->r_map) {
+// Stuff is not going in at the end, means this is not the first irc,
+// or the first imap, means r_map should be there!
+			newmap = reallocMem(cw->r_map, room * LMSIZE);
+			if (destl < svdol)
+				memmove(newmap + destl + nlines + 1, newmap + destl + 1,
+					(svdol - destl + 1) * LMSIZE);
+			else
+				memset(newmap + destl + nlines + 1, 0, LMSIZE);
+		} else {
+			newmap = allocZeroMem(room * LMSIZE);
+			for(i = 1; i <= destl; ++i)
+				newmap[i].text = (uchar*)emptyString;
 		}
 // the added lines
 		for(i = 1; i <= nlines; ++i)
 			newmap[destl + i].text = cw->ircoMode ? (uchar*)cloneString(timestring) : (uchar*)emptyString;
-// put on the last piece
-		if (destl < svdol) {
-// Stuff is not going in at the end, means this is not the first irc,
-// or the first imap, means r_map should be there!
-			memcpy(newmap + destl + nlines + 1, cw->r_map + destl + 1,
-			       (svdol - destl + 1) * LMSIZE);
-		}
-		nzFree(cw->r_map);
 		cw->r_map = newmap;
 	}
 
@@ -1285,17 +1635,17 @@ void addToMap(int nlines, int destl)
 // gflag is still there, but it is for session 1.
 	if(gflag_w != cw) return;
 
-	newg = allocMem(cw->dol + 1);
-	if (destl)
-		memcpy(newg, gflag, destl + 1);
-	memset(newg + destl + 1, 0, nlines);
+	gflag = reallocMem(gflag, mapRoom(cw->dol + 1));
 	if (destl < svdol)
-		memcpy(newg + destl + nlines + 1, gflag + destl + 1,
-		       (svdol - destl));
-	free(gflag), gflag = newg;
+		memmove(gflag + destl + nlines + 1, gflag + destl + 1,
+			svdol - destl);
+	memset(gflag + destl + 1, 0, nlines);
 }
 
-static int text2linemap(const uchar *inbuf, int length, bool *nlflag)
+// Break text into lines. If inplace is set, the text already lives
+// in that chunk, and the lines point into it rather than copying.
+static int text2linemap0(uchar *inbuf, int length, bool *nlflag,
+struct lineChunk *inplace)
 {
 	int i, j, lines = 0;
 	struct lineMap *t;
@@ -1317,18 +1667,31 @@ static int text2linemap(const uchar *inbuf, int length, bool *nlflag)
 	}
 
 	newpiece = t = allocZeroMem(lines * LMSIZE);
+// one chunk holds all these lines, with room for the newline we might add
+	if (!inplace)
+		chunkSpace(length + *nlflag);
 	i = 0;
 	while (i < length) {	// another line
 		j = i;
 		while (i < length)
 			if (inbuf[i++] == '\n')
 				break;
-		if (inbuf[i - 1] == '\n') {
+		if (inplace && inbuf[i - 1] == '\n') {
+			t->text = inbuf + j;
+			++inplace->live;
+			++t;
+			continue;
+		}
+		if (inplace) {
+// last line with no nl, it can't be extended in place
+			t->text = allocMem(i - j + 1);
+			t->text[i - j] = '\n';
+		} else if (inbuf[i - 1] == '\n') {
 // normal line
-			t->text = allocMem(i - j);
+			t->text = chunkLine(i - j);
 		} else {
 // last line with no nl
-			t->text = allocMem(i - j + 1);
+			t->text = chunkLine(i - j + 1);
 			t->text[i - j] = '\n';
 		}
 		memcpy(t->text, inbuf + j, i - j);
@@ -1337,11 +1700,17 @@ static int text2linemap(const uchar *inbuf, int length, bool *nlflag)
 	return lines;
 }
 
+static int text2linemap(const uchar *inbuf, int length, bool *nlflag)
+{
+	return text2linemap0((uchar *)inbuf, length, nlflag, 0);
+}
+
 // Add a block of text into the buffer; uses text2linemap() and addToMap().
-bool addTextToBuffer(const uchar *inbuf, int length, int destl, bool showtrail)
+static bool addTextToBuffer0(uchar *inbuf, int length, int destl,
+bool showtrail, struct lineChunk *inplace)
 {
 	bool nlflag;
-	int lines = text2linemap(inbuf, length, &nlflag);
+	int lines = text2linemap0(inbuf, length, &nlflag, inplace);
 	if(!lines) return true;
 	if (destl == cw->dol)
 		cw->nlMode = false;
@@ -1354,6 +1723,11 @@ bool addTextToBuffer(const uchar *inbuf, int length, int destl, bool showtrail)
 	return true;
 }
 
+bool addTextToBuffer(const uchar *inbuf, int length, int destl, bool showtrail)
+{
+	return addTextToBuffer0((uchar *)inbuf, length, destl, showtrail, 0);
+}
+
 void addTextToBackend(const char *inbuf)
 {
 	bool nlflag;
@@ -1504,7 +1878,7 @@ void delText(int start, int end)
 // browse / sql / irc has no undo command.
 	if (cw->browseMode | cw->sqlMode | cw->ircoMode | cw->imapMode1 | cw->imapMode2) {
 		for (ln = start; ln <= end; ++ln)
-			nzFree(cw->map[ln].text);
+			freeLineText(cw->map[ln].text);
 	} else {
 		undoPush();
 	}
@@ -1519,7 +1893,7 @@ void delText(int start, int end)
 // if you are looking at directories with ls-s or some such,
 // we have to delete the corresponding stat information.
 		for (ln = start; ln <= end; ++ln)
-			nzFree(cw->r_map[ln].text);
+			freeLineText(cw->r_map[ln].text);
 		memmove(cw->r_map + start, cw->r_map + end + 1,
 			(cw->dol - end + 1) * LMSIZE);
 	}
@@ -1617,9 +1991,9 @@ static bool delTextG(char action, int n, int back)
 			if(t2) {
 				int n2;
 				for(n2 = 1; n2 <= back; ++n2)
-					nzFree(cw->r_map[j + n2].text);
+					freeLineText(cw->r_map[j + n2].text);
 				for(n2 = 0; n2 <= n; ++n2)
-					nzFree(t2[n2].text);
+					freeLineText(t2[n2].text);
 				t2 += n;
 			}
 			cw->dot = j;
@@ -1900,6 +2274,132 @@ static bool joinTextG(char action, int n, int back, const char *fs)
 	return rc;
 }
 
+/*********************************************************************
+Read a large file by mapping it into memory, rather than reading it.
+The lines of the buffer point right into the mapped file,
+so there is no copy, and the kernel pages the text in as we need it.
+The mapping is private; a line can be changed in place without
+changing the file, though lines are seldom changed in place.
+The mapped region becomes a chunk of lines, and it is unmapped
+when the last of its lines is freed, see freeLineText().
+A private mapping is not a copy; if someone writes the file,
+or truncates it, the lines change underneath us, or we take SIGBUS.
+So only map a file that can't change: on a read only filesystem,
+or our own file, with no write permission for anyone.
+Anyone else's file, a system log for instance, could be rewritten
+by its owner, or rotated by logrotate copytruncate, so it is read as usual.
+There is a page of zeros past the end of the mapping,
+so a scan that looks one byte ahead at the end of the file is safe.
+The file is processed in parts, as fdIntoMemory() does.
+If a part has to be converted, iso8859 to utf8 or some such,
+then it is copied in the usual way.
+A dos file is fixed in place, which makes private copies of those pages,
+but it is still one pass and no allocation per line.
+A last line with no newline is the only line copied out of the mapping.
+Return 1 for success, 0 for failure, and -1 to read the file the usual way.
+*********************************************************************/
+
+#define MAPFILESIZE 0x1000000
+#define MAPPARTSIZE 0x4000000
+
+static int readMapped(const char *filename)
+{
+	struct stat st;
+	struct statvfs vfs;
+	int fh, partSize;
+	uchar *base, *s;
+	size_t size, start, end;
+	char *rbuf;
+	bool isAllocated, rc = true;
+	struct lineChunk *c;
+
+	if (stat(filename, &st) || !S_ISREG(st.st_mode) ||
+	    st.st_size < MAPFILESIZE)
+		return -1;
+	fh = open(filename, O_RDONLY | O_BINARY | O_CLOEXEC);
+	if (fh < 0)
+		return -1;
+// the file we opened, which can't change
+	if (fstat(fh, &st) || fstatvfs(fh, &vfs) ||
+	    (!(vfs.f_flag & ST_RDONLY) &&
+	     ((st.st_mode & 0222) || st.st_uid != geteuid()))) {
+		close(fh);
+		return -1;
+	}
+	size = st.st_size;
+	if ((off_t)size != st.st_size) {
+		close(fh);
+		return -1;
+	}
+	if (!mapPage)
+		mapPage = sysconf(_SC_PAGESIZE);
+// reserve the file and a page of zeros beyond, then map the file over it
+	base = mmap(0, size + mapPage, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base != MAP_FAILED &&
+	    mmap(base, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+		 fh, 0) == MAP_FAILED) {
+		munmap(base, size + mapPage);
+		base = MAP_FAILED;
+	}
+	close(fh);
+	if (base == MAP_FAILED)
+		return -1;
+// utf16 and utf32 are converted all at once, not by parts
+	if (byteOrderMark(base, 4)) {
+		munmap(base, size + mapPage);
+		return -1;
+	}
+	debugPrint(3, "map %s", filename);
+
+	c = newChunk(size, base);
+	c->owner = cw;
+	fileSize = 0;
+	for (start = 0; start < size; start = end) {
+		end = size;
+		if (size - start > MAPPARTSIZE) {
+// break on a newline, as fdIntoMemory does
+			s = memrchr(base + start, '\n', MAPPARTSIZE);
+			if (!s)
+				s = memchr(base + start + MAPPARTSIZE, '\n',
+					   size - start - MAPPARTSIZE);
+			if (s)
+				end = s + 1 - base;
+		}
+		if (end - start >= 0x7fffff00) {
+			setError(MSG_BigFile);
+			rc = false;
+			break;
+		}
+		rbuf = (char *)base + start;
+		partSize = end - start;
+		fileSize += partSize;
+		isAllocated = false;
+		if (!looksBinary((uchar *) rbuf, partSize)) {
+			diagnoseAndConvert(&rbuf, &isAllocated, &partSize,
+					   !start, true);
+		} else if (binaryDetect & !cw->binMode) {
+			if(debugLevel >= 1)
+				i_puts(MSG_BinaryData);
+			cw->binMode = true;
+		}
+		if (isAllocated) {
+			rc = addTextToBuffer((pst) rbuf, partSize, endRange, true);
+			nzFree(rbuf);
+		} else {
+			rc = addTextToBuffer0((pst) rbuf, partSize, endRange, true, c);
+		}
+		endRange = cw->dot;
+		if (!rc)
+			break;
+	}
+
+	c->owner = 0;
+	if (!c->live)
+		deleteChunk(findChunk(c->data));
+	return rc;
+}
+
 // Read a file, or url, into the current buffer.
 static bool readFile(const char *filename, bool newwin,
 		     int fromframe, const char *fromthis, const char *orig_head,
@@ -1976,6 +2476,8 @@ uchar prebrowse, const Tag *gotag)
 		g.thisfile = fromthis;
 		g.custom_h = orig_head;
 		g.cf = cf;
+// look ahead for scripts and css, if we are going to browse this page
+		g.preload = (cmd == 'b' && allowJS && !blockJS && down_jsbg);
 		rc = httpConnect(&g);
 		serverData = g.buffer;
 		serverDataLen = g.length;
@@ -2160,6 +2662,14 @@ badfile:
 // then there's no need to browse the result.
 		if (cf->mt->outtype == 't')
 			cmd = 'e';
+	} else if (!fromframe && !prebrowse &&
+		   (inparts = readMapped(filename)) >= 0) {
+		if (!inparts)
+			goto badfile;
+// serverData doesn't mean anything here, but it has to be not null
+		serverData = emptyString;
+		serverDataLen = 0;
+		return true;
 	} else {
 
 		inparts = 1, fileSize = 0;
@@ -3361,6 +3871,73 @@ static pcre2_match_data *match_data;
 static pcre2_code *re_cc;	/* compiled */
 bool re_utf8 = true;
 
+/*********************************************************************
+Compiled regular expressions are kept in a small cache,
+most recently used first, keyed on the pattern and the compile options,
+which carry the case flag and utf8 mode.
+Scripts search for the same thing over and over,
+and s//x/ reuses the pattern of the last search,
+so this saves the compile, and the jit compile, which costs more.
+Each entry has its own match data.
+re_cc and match_data point into the cache,
+and regexpRelease() lets go of them without freeing anything.
+*********************************************************************/
+
+#define RECACHESIZE 16
+struct reCache {
+	char *pattern;
+	int opt;
+	pcre2_code *code;
+	pcre2_match_data *md;
+};
+static struct reCache reCache[RECACHESIZE];
+static int reCacheNum;
+
+static bool reCacheFind(const char *re, int opt)
+{
+	struct reCache hold;
+	int i;
+	for (i = 0; i < reCacheNum; ++i)
+		if (reCache[i].opt == opt && stringEqual(reCache[i].pattern, re))
+			break;
+	if (i == reCacheNum)
+		return false;
+// move it to the front
+	hold = reCache[i];
+	memmove(reCache + 1, reCache, i * sizeof(struct reCache));
+	reCache[0] = hold;
+	re_cc = hold.code, match_data = hold.md;
+	debugPrint(8, "regexp cache hit %s", re);
+	return true;
+}
+
+static void reCacheAdd(const char *re, int opt)
+{
+	struct reCache *r;
+// jit is optional, pcre2_match falls back to the interpreter without it
+	pcre2_jit_compile(re_cc, PCRE2_JIT_COMPLETE);
+	match_data = pcre2_match_data_create_from_pattern(re_cc, NULL);
+	if (reCacheNum == RECACHESIZE) {
+		r = reCache + --reCacheNum;
+		free(r->pattern);
+		pcre2_match_data_free(r->md);
+		pcre2_code_free(r->code);
+	}
+	memmove(reCache + 1, reCache, reCacheNum * sizeof(struct reCache));
+	++reCacheNum;
+	r = reCache;
+	r->pattern = cloneString(re);
+	r->opt = opt;
+	r->code = re_cc;
+	r->md = match_data;
+}
+
+static void regexpRelease(void)
+{
+	re_cc = 0;
+	match_data = 0;
+}
+
 static void regexpCompile(const char *re, bool ci)
 {
 	static signed char try8 = 0;	/* 1 is utf8 on, -1 is utf8 off */
@@ -3388,6 +3965,9 @@ top:
 		}
 	}
 
+	if (reCacheFind(re, re_opt))
+		return;
+
 	re_cc = pcre2_compile((uchar*)re, PCRE2_ZERO_TERMINATED, re_opt, &re_error, &re_offset, 0);
 	if (!re_cc && try8 > 0 && re_error == PCRE2_ERROR_UTF_IS_DISABLED) {
 		i_puts(MSG_PcreUtf8);
@@ -3402,7 +3982,7 @@ top:
 		setError(MSG_RexpError, "ERROR");
 	else
 // re_cc and match_data rise and fall together.
-		match_data = pcre2_match_data_create_from_pattern(re_cc, NULL);
+		reCacheAdd(re, re_opt);
 }
 
 /* Get the start or end of a range.
@@ -3473,11 +4053,11 @@ const char **split)
  * since the expressions are simple, and the lines are short. */
 		incr = (first == '/' ? 1 : -1);
 		while (true) {
-			char *subject;
+			pst subject;
+			int len;
 			ln += incr;
 			if (!searchWrap && (ln == 0 || ln > cw->dol)) {
-				pcre2_match_data_free(match_data);
-				pcre2_code_free(re_cc);
+				regexpRelease();
 				setError(MSG_NotFound);
 				return false;
 			}
@@ -3485,14 +4065,13 @@ const char **split)
 				ln = 1;
 			if (ln == 0)
 				ln = cw->dol;
-			subject = (char *)fetchLine(ln, 1);
+			subject = borrowLineWindow(ln, cw, &len);
 			re_count =
-			    pcre2_match(re_cc, (uchar*)subject,
-				      pstLength((pst) subject) - 1, 0, 0,
+			    pcre2_match(re_cc, subject, len, 0, 0,
 				      match_data, NULL);
 //  {uchar snork[300]; pcre2_get_error_message(re_count, snork, 300); puts(snork); }
 			re_vector = pcre2_get_ovector_pointer(match_data);
-			free(subject);
+			releaseLine(subject, ln, cw);
 // An error in evaluation  usually happens because this line has invalid utf8
 			if (re_count < -1 && re_utf8 && !bad_utf8_alert) {
 				i_puts(MSG_BadUtf8);
@@ -3501,14 +4080,12 @@ const char **split)
 			if ((re_count >= 0) ^ unmatch)
 				break;
 			if (ln == cw->dot) {
-				pcre2_match_data_free(match_data);
-				pcre2_code_free(re_cc);
+				regexpRelease();
 				setError(MSG_NotFound);
 				return false;
 			}
 		}		/* loop over lines */
-		pcre2_match_data_free(match_data);
-		pcre2_code_free(re_cc);
+		regexpRelease();
 /* and ln is the line that matches */
 	}
 	/* Now add or subtract from this number */
@@ -3534,6 +4111,94 @@ const char **split)
 	return true;
 }
 
+/*********************************************************************
+Mark the lines that match, or don't match, for g// or v//.
+This is the slow part on a big buffer, and each line stands alone,
+so split the range across threads, each with its own match data.
+The compiled pattern can be shared for matching.
+Threads write to separate stretches of gflag, so no locking is needed,
+and the marks are the same as if we ran the range in one pass.
+Messages are left to the main thread.
+A small range isn't worth the thread overhead, and runs inline.
+*********************************************************************/
+
+#define GLOBALSLICE 50000	// minimum lines per thread
+#define GLOBALTHREADS 16
+
+struct globalPart {
+	int start, end;
+	int count;
+	bool badutf8;
+	bool started;
+	char cmd;
+	pthread_t tid;
+};
+
+static void *globalMatch(void *vp)
+{
+	struct globalPart *gp = vp;
+	pcre2_match_data *md = pcre2_match_data_create_from_pattern(re_cc, NULL);
+	int i, rc;
+	for (i = gp->start; i <= gp->end; ++i) {
+		int len;
+		pst subject = borrowLineWindow(i, gflag_w, &len);
+		rc = pcre2_match(re_cc, subject, len, 0, 0, md, NULL);
+		releaseLine(subject, i, gflag_w);
+		if (rc < -1)
+			gp->badutf8 = true;
+		if ((rc < 0 && gp->cmd == 'v') || (rc >= 0 && gp->cmd == 'g'))
+			gflag[i] = true, ++gp->count;
+	}
+	pcre2_match_data_free(md);
+	return NULL;
+}
+
+static int globalMarks(void)
+{
+	struct globalPart parts[GLOBALTHREADS];
+	int total = endRange - startRange + 1;
+	int n = total / GLOBALSLICE, span, k, gcnt = 0;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	bool badutf8 = false;
+
+	if (n > ncpu)
+		n = ncpu;
+	if (n > GLOBALTHREADS)
+		n = GLOBALTHREADS;
+	if (n < 1)
+		n = 1;
+	span = (total + n - 1) / n;
+	for (k = 0; k < n; ++k) {
+		struct globalPart *gp = parts + k;
+		gp->start = startRange + k * span;
+		gp->end = gp->start + span - 1;
+		if (gp->end > endRange)
+			gp->end = endRange;
+		gp->count = 0;
+		gp->badutf8 = gp->started = false;
+		gp->cmd = cmd;
+// the main thread takes the first part
+		if (k && !pthread_create(&gp->tid, NULL, globalMatch, gp))
+			gp->started = true;
+	}
+	debugPrint(4, "g// %d lines %d threads", total, n);
+	for (k = 0; k < n; ++k) {
+		struct globalPart *gp = parts + k;
+		if (gp->started)
+			pthread_join(gp->tid, NULL);
+		else
+			globalMatch(gp);
+		gcnt += gp->count;
+		badutf8 |= gp->badutf8;
+	}
+
+	if (badutf8 && re_utf8 && !bad_utf8_alert) {
+		i_puts(MSG_BadUtf8);
+		bad_utf8_alert = true;
+	}
+	return gcnt;
+}
+
 /* Apply a regular expression to each line, and then execute
  * a command for each matching, or nonmatching, line.
  * This is the global feature, g/re/p, which gives us the word grep. */
@@ -3581,23 +4246,8 @@ static bool doGlobal(const char *line)
 		return false;
 	gflag = allocZeroMem(sizeof(char*) * (cw->dol+1));
 	gflag_w = cw;
-	for (i = startRange; i <= endRange; ++i) {
-		char *subject = (char *)fetchLine(i, 1);
-		re_count =
-		    pcre2_match(re_cc, (uchar*)subject, pstLength((pst) subject) - 1,
-			      0, 0, match_data, NULL);
-		re_vector = pcre2_get_ovector_pointer(match_data);
-		free(subject);
-		if (re_count < -1 && re_utf8 && !bad_utf8_alert) {
-			i_puts(MSG_BadUtf8);
-		bad_utf8_alert = true;
-		}
-		if ((re_count < 0 && cmd == 'v')
-		    || (re_count >= 0 && cmd == 'g'))
-			gflag[i] = true, ++gcnt;
-	}
-	pcre2_match_data_free(match_data);
-	pcre2_code_free(re_cc);
+	gcnt = globalMarks();
+	regexpRelease();
 
 	if (!gcnt) {
 		setError((cmd == 'v') + MSG_NoMatchG);
@@ -4544,7 +5194,7 @@ static int substituteText(const char *line)
 // normal substitute
 				mptr = newmap ? newmap + ln2 : cw->map + ln;
 				if(cw->sqlMode | cw->imapMode1)
-					nzFree(mptr->text);
+					freeLineText(mptr->text);
 				mptr->text = allocMem(replaceStringLength + 1);
 				memcpy(mptr->text, replaceString,
 				       replaceStringLength + 1);
@@ -4605,10 +5255,7 @@ static int substituteText(const char *line)
 		continue;
 
 abort:
-		if (re_cc) {
-			pcre2_match_data_free(match_data);
-			pcre2_code_free(re_cc);
-		}
+		regexpRelease();
 		nzFree(replaceString);
 	// we may have just freed the result of a breakline command
 		breakLineResult = 0;
@@ -4637,10 +5284,7 @@ cw->dol = ln2 - 1;
 
 	if(!ok) return -1;
 
-	if (re_cc) {
-		pcre2_match_data_free(match_data);
-		pcre2_code_free(re_cc);
-	}
+	regexpRelease();
 
 	if (!lastSubst) {
 		if (!globSub) {
@@ -5155,6 +5799,23 @@ down_again:
 		return true;
 	}
 
+	if (stringEqual(line, "redo")) {
+		cmd = 'e';
+		return undoRedo(true);
+	}
+
+	if (!strncmp(line, "undo=", 5) && isdigitByte(line[5])) {
+		undoDepth = atoi(line + 5);
+		if (undoDepth < 1)
+			undoDepth = 1;
+		return true;
+	}
+
+	if(stringEqual(line, "undo=")) {
+		eb_printf("%d\n", undoDepth);
+		return true;
+	}
+
 	if (line[0] == 'u' && line[1] == 'a' && isdigitByte(line[2])
 	    && (!line[3] || (isdigitByte(line[3]) && !line[4]))) {
 		char *t = 0;
@@ -5484,6 +6145,7 @@ et_go:
 			fnext = f->next;
 			delTimers(f);
 			freeJSContext(f);
+			preloadDrop(f);
 			nzFree(f->dw);
 			nzFree(f->hbase);
 			nzFree(f->firstURL);
@@ -7648,20 +8310,8 @@ dest_ok:
 	}
 
 	if (cmd == 'u') {
-		Window *uw = &undoWindow;
-		struct lineMap *swapmap;
-		if (!cw->undoable) {
-			setError(MSG_NoUndo);
+		if (!undoRedo(false))
 			goto fail;
-		}
-/* swap, so we can undo our undo, if need be */
-		i = uw->dot, uw->dot = cw->dot, cw->dot = i;
-		i = uw->dol, uw->dol = cw->dol, cw->dol = i;
-		for (j = 0; j < MARKLETTERS; ++j) {
-			i = uw->labels[j], uw->labels[j] =
-			    cw->labels[j], cw->labels[j] = i;
-		}
-		swapmap = uw->map, uw->map = cw->map, cw->map = swapmap;
 		goto success;
 	}
 
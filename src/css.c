@@ -352,11 +352,48 @@ struct shortcache {
 	struct shortcache *next;
 	char *url;
 	char *data;
+	bool failed;		// couldn't fetch it, data is empty
 };
 
-struct cssmaster {
+/*********************************************************************
+A page usually pulls in the same style sheets as the last page on that site,
+and a big sheet takes longer to parse than to apply.
+So each sheet is parsed on its own, and the parsed sheet is kept
+for the rest of the session, in a short list, most recent first.
+The key is the text of the sheet, which starts with @ebdelim0 and its url,
+so the same text from two different places is two different sheets.
+That matters, because @import urls are resolved against that place.
+Sheets are shared across frames and windows, hence the reference count.
+The cache holds one reference, each frame using the sheet holds another.
+Nothing in a parsed sheet is changed by matching, except d->highspec,
+which is computed and consumed on the spot.
+*********************************************************************/
+
+struct cssheet {
+	struct cssheet *next;	// in the session cache
+	char *text;		// the sheet before it was parsed
+	int len;
+	unsigned hash;
+	bool js;		// javascript was on, for @media (scripting)
+	int refs;
 	struct desc *descriptors;
+	char *loadstring;	// for makeSheets
+	char *imports;		// url tab hash, for each imported file
+	int loadcount;
+	int errorBuckets[CSS_ERROR_LAST];
+};
+
+#define CSSCACHESIZE 100
+#define CSSCACHEBYTES 10000000
+static struct cssheet *sheetCache;
+static int sheetCache_n, sheetCache_l, sheetHits;
+
+struct cssmaster {
+	struct cssheet **sheets;
+	int numsheets;
 	struct shortcache *cache;
+// import replacements from implocal, don't use parsed sheets from elsewhere
+	bool localimports;
 };
 
 static void cssPiecesFree(struct desc *d);
@@ -375,22 +412,26 @@ static void build_doclist(Tag *top);
 static void hashBuild(void);
 static void hashFree(void);
 static void hashPrint(void);
-static Tag **bestListAtomic(struct asel *a);
+static void bloomBuild(void);
+static Tag **bestListAtomic(struct asel *a, int *np);
 static void cssEverybody(void);
+static bool bloomReject(const Tag *t, const struct asel *a);
 
-static char *fromShortCache(const char *url)
+static char *fromShortCache(const char *url, bool *failed)
 {
 	struct shortcache *c;
 	struct cssmaster *cm = cf->cssmaster;
 	if (!cm)
 		return 0;
 	for (c = cm->cache; c; c = c->next)
-		if (stringEqual(url, c->url))
+		if (stringEqual(url, c->url)) {
+			*failed = c->failed;
 			return c->data;
+		}
 	return 0;
 }
 
-static void intoShortCache(const char *url, char *data)
+static void intoShortCache(const char *url, char *data, bool failed)
 {
 	struct shortcache *c;
 	struct cssmaster *cm = cf->cssmaster;
@@ -403,6 +444,7 @@ static void intoShortCache(const char *url, char *data)
 	cm->cache = c;
 	c->url = cloneString(url);
 	c->data = data;
+	c->failed = failed;
 }
 
 void writeShortCache(void)
@@ -458,7 +500,7 @@ static void readShortCache(struct cssmaster *cm)
 			continue;
 		}
 		*s++ = 0;
-		c = allocMem(sizeof(struct shortcache));
+		c = allocZeroMem(sizeof(struct shortcache));
 		c->url = cloneString(s);
 		fileIntoMemory(line, &c->data, &length, 0);
 // fileIntoMemory puts a null byte on the end
@@ -469,6 +511,7 @@ static void readShortCache(struct cssmaster *cm)
 	fclose(f);
 	if (n)
 		debugPrint(3, "%d import file replacements", n);
+	cm->localimports = (n > 0);
 }
 
 // Step back through a css string looking for the base url.
@@ -794,6 +837,75 @@ static void loadPack(const char *lhs, const char *rhs)
 	stringAndString(&loadstring, &loadstring_l, "}\n");
 }
 
+/*********************************************************************
+Fetch a file for @import, and put it in the short cache.
+The result is empty if it can't be had, and then *failed is set.
+A sheet with a failed import is not kept in the sheet cache;
+next time the import might work.
+Each import, and a hash of what it brought in, goes on importKey,
+which becomes part of the sheet cache key, see sheetLoad().
+*********************************************************************/
+
+static char *importKey;
+static int importKey_l;
+static bool importFailed;
+static unsigned sheetHash(const char *s, int len);
+
+static char *importFetch(char *newurl, bool *failed)
+{
+	struct i_get g;
+	char *a = NULL;
+
+	*failed = true;
+	debugPrint(3, "css source %s", newurl);
+	memset(&g, 0, sizeof(g));
+	g.thisfile = cf->fileName;
+	g.uriEncoded = true;
+	g.url = newurl;
+	if (!intFlag && httpConnect(&g)) {
+		nzFree(g.cfn);
+		nzFree(g.referrer);
+		if (g.code == 200) {
+			*failed = false;
+			a = force_utf8(g.buffer, g.length);
+			if (!a)
+				a = g.buffer;
+			else
+				nzFree(g.buffer);
+			if (g.content[0]
+			    && !stringEqual(g.content, "text/css")
+			    && !stringEqual(g.content, "text/plain")) {
+				debugPrint(3,
+					   "css suppressed because content type is %s",
+					   g.content);
+				cnzFree(a);
+				a = NULL;
+			}
+		} else {
+			nzFree(g.buffer);
+			if (debugLevel >= 3)
+				i_printf(MSG_GetCSS, g.url, g.code);
+		}
+	} else {
+		if (debugLevel >= 3)
+			i_printf(MSG_GetCSS2);
+	}
+	if (!a)
+		a = emptyString;
+	intoShortCache(newurl, a, *failed);
+	return a;
+}
+
+static void importNote(const char *url, const char *data, bool failed)
+{
+	if (failed)
+		importFailed = true;
+	stringAndString(&importKey, &importKey_l, url);
+	stringAndChar(&importKey, &importKey_l, '\t');
+	stringAndNum(&importKey, &importKey_l, (int)sheetHash(data, strlen(data)));
+	stringAndChar(&importKey, &importKey_l, '\n');
+}
+
 // The input string is assumed allocated, it could be reallocated.
 static struct desc *cssPieces(char *s)
 {
@@ -809,6 +921,9 @@ static struct desc *cssPieces(char *s)
 
 	loadcount = 0;
 	memset(errorBuckets, 0, sizeof(errorBuckets));
+	nzFree(importKey);
+	importKey = initString(&importKey_l);
+	importFailed = false;
 
 top:
 	uncomment(s);
@@ -823,8 +938,8 @@ top:
 			iu2 += 4;
 			t = iu2;
 			while ((c = *t)) {
-				struct i_get g;
 				char *lasturl, *newurl;
+				bool failed = false;
 				if (c == '"' || c == '\'') {
 					n = closeString(t + 1, c);
 					if (n < 0)	// should never happen
@@ -850,49 +965,9 @@ top:
 				newurl = resolveURL(lasturl, iu2);
 				nzFree(lasturl);
 				*iu1 = 0;
-				if ((a = fromShortCache(newurl)))
-					goto imported_data;
-				debugPrint(3, "css source %s", newurl);
-				memset(&g, 0, sizeof(g));
-				g.thisfile = cf->fileName;
-				g.uriEncoded = true;
-				g.url = newurl;
-				if (!intFlag && httpConnect(&g)) {
-					nzFree(g.cfn);
-					nzFree(g.referrer);
-					if (g.code == 200) {
-						a = force_utf8(g.buffer,
-							       g.length);
-						if (!a)
-							a = g.buffer;
-						else
-							nzFree(g.buffer);
-						if (g.content[0]
-						    && !stringEqual(g.content,
-								    "text/css")
-						    && !stringEqual(g.content,
-								    "text/plain"))
-						{
-							debugPrint(3,
-								   "css suppressed because content type is %s",
-								   g.content);
-							cnzFree(a);
-							a = NULL;
-						}
-					} else {
-						nzFree(g.buffer);
-						if (debugLevel >= 3)
-							i_printf(MSG_GetCSS,
-								 g.url, g.code);
-					}
-				} else {
-					if (debugLevel >= 3)
-						i_printf(MSG_GetCSS2);
-				}
-				if (!a)
-					a = emptyString;
-				intoShortCache(newurl, a);
-imported_data:
+				if (!(a = fromShortCache(newurl, &failed)))
+					a = importFetch(newurl, &failed);
+				importNote(newurl, a, failed);
 				ignore = asprintf(&t,
 					"%s\n@ebdelim1%s{}\n%s\n@ebdelim2{}\n%s",
 					s, newurl, a, iu3);
@@ -1244,6 +1319,180 @@ lastrule:
 	return d1;
 }
 
+static unsigned sheetHash(const char *s, int len)
+{
+	unsigned h = 2166136261U;
+	while (len--)
+		h = (h ^ (uchar) * s++) * 16777619U;
+	return h;
+}
+
+static void sheetUnref(struct cssheet *sh)
+{
+	if (--sh->refs)
+		return;
+	cssPiecesFree(sh->descriptors);
+	nzFree(sh->text);
+	nzFree(sh->loadstring);
+	nzFree(sh->imports);
+	free(sh);
+}
+
+// drop the oldest sheets if the cache is too big
+static void sheetCacheTrim(void)
+{
+	struct cssheet *sh, *prev;
+	while (sheetCache_n > CSSCACHESIZE ||
+	       (sheetCache_l > CSSCACHEBYTES && sheetCache_n > 1)) {
+		prev = 0;
+		for (sh = sheetCache; sh->next; sh = sh->next)
+			prev = sh;
+		prev->next = 0;
+		--sheetCache_n, sheetCache_l -= sh->len;
+		sheetUnref(sh);
+	}
+}
+
+// Are the files this sheet imported still what they were?
+// They come from the short cache, or they are fetched, as the parse would.
+static bool importsCurrent(const struct cssheet *sh)
+{
+	char *list = cloneString(sh->imports), *url, *t, *a;
+	bool failed = false, rc = true;
+	unsigned h;
+	for (url = list; (t = strchr(url, '\t')); url = t) {
+		*t++ = 0;
+		h = strtoul(t, &t, 10);
+		if (*t == '\n')
+			++t;
+		if (!(a = fromShortCache(url, &failed)))
+			a = importFetch(url, &failed);
+		if (failed || sheetHash(a, strlen(a)) != h) {
+			rc = false;
+			break;
+		}
+	}
+	free(list);
+	return rc;
+}
+
+/*********************************************************************
+Parse a style sheet, or find it already parsed.
+The key is the text of the sheet, and whether js is on,
+since @media (scripting) depends on that,
+and the files it imports, which could change on the server.
+A sheet whose imports couldn't be fetched is not kept.
+The result carries a reference for the caller.
+*********************************************************************/
+
+static struct cssheet *sheetLoad(const char *s, int len, bool usecache)
+{
+	struct cssheet *sh, *prev = 0;
+	unsigned h = sheetHash(s, len);
+
+	if (!usecache)
+		goto parse;
+	for (sh = sheetCache; sh; prev = sh, sh = sh->next) {
+		if (sh->hash != h || sh->len != len || sh->js != isJSAlive ||
+		    memcmp(sh->text, s, len))
+			continue;
+		if (*sh->imports && !importsCurrent(sh)) {
+// out of date, drop it and parse again
+			if (prev)
+				prev->next = sh->next;
+			else
+				sheetCache = sh->next;
+			--sheetCache_n, sheetCache_l -= sh->len;
+			sheetUnref(sh);
+			break;
+		}
+		if (prev) {
+// move to the front
+			prev->next = sh->next;
+			sh->next = sheetCache;
+			sheetCache = sh;
+		}
+		++sh->refs, ++sheetHits;
+		cssPiecesPrint(sh->descriptors);
+		return sh;
+	}
+
+parse:
+	sh = allocZeroMem(sizeof(struct cssheet));
+	sh->len = len, sh->hash = h, sh->refs = 1;
+	sh->js = isJSAlive;
+	loadstring = initString(&loadstring_l);
+	sh->descriptors = cssPieces(pullString(s, len));
+	sh->loadstring = loadstring;
+	loadstring = 0;
+	sh->imports = importKey;
+	importKey = 0;
+	sh->loadcount = loadcount;
+	memcpy(sh->errorBuckets, errorBuckets, sizeof(errorBuckets));
+	if (!usecache || importFailed)
+		return sh;
+	sh->text = pullString(s, len);
+	++sh->refs;
+	sh->next = sheetCache;
+	sheetCache = sh;
+	++sheetCache_n, sheetCache_l += len;
+	sheetCacheTrim();
+	return sh;
+}
+
+/*********************************************************************
+Split the css from cssGather into its style sheets, and load each one.
+A sheet begins with @ebdelim0 and its url.
+Anything before the first delimiter goes with the first sheet.
+The incoming string is freed.
+Error statistics are summed across the sheets, for cssStats().
+*********************************************************************/
+
+static void sheetsLoad(struct cssmaster *cm, char *start)
+{
+	static const char delim[] = "@ebdelim0";
+	struct cssheet *sh;
+	char *s, *t;
+	int n, i;
+// cssPieces() resets the globals, so sum into these
+	int count = 0, buckets[CSS_ERROR_LAST];
+
+// count the delimiters, and the piece in front of the first one
+	for (n = 1, s = start; (s = strstr(s, delim)); s += sizeof(delim) - 1)
+		++n;
+	cm->sheets = allocMem((n + 1) * sizeof(struct cssheet *));
+	cm->numsheets = 0;
+	memset(buckets, 0, sizeof(buckets));
+	sheetHits = 0;
+
+	for (s = start; *s; s = t) {
+		t = strstr(s + 1, delim);
+		if (!t)
+			t = s + strlen(s);
+		sh = sheetLoad(s, t - s, !cm->localimports);
+		cm->sheets[cm->numsheets++] = sh;
+		count += sh->loadcount;
+		for (i = 0; i < CSS_ERROR_LAST; ++i)
+			buckets[i] += sh->errorBuckets[i];
+	}
+	nzFree(start);
+	loadcount = count;
+	memcpy(errorBuckets, buckets, sizeof(buckets));
+
+	if (cm->numsheets)
+		debugPrint(3, "%d style sheets, %d already parsed",
+			   cm->numsheets, sheetHits);
+}
+
+static void sheetsFree(struct cssmaster *cm)
+{
+	int i;
+	for (i = 0; i < cm->numsheets; ++i)
+		sheetUnref(cm->sheets[i]);
+	nzFree(cm->sheets);
+	cm->sheets = 0, cm->numsheets = 0;
+}
+
 static void cssParseLeft(struct desc *d)
 {
 	char *s = d->lhs;
@@ -1653,14 +1902,15 @@ Frame *frameFromWindow(int gsn)
 	return 0;
 }
 
-// The selection string (start) must be allocated - css will use it in place,
-// separating it into all its descriptors.
-// cssFree() will free it.
+// The selection string (start) must be allocated.
+// It is cut into style sheets, which are parsed or found already parsed,
+// and then it is freed.
 void cssDocLoad(int frameNumber, char *start, bool pageload)
 {
 	Frame *save_cf = cf;
 	struct cssmaster *cm;
 	bool recompile = false;
+	int i;
 	Frame *new_f = frameFromWindow(frameNumber);
 // no clue what to do if new_f is null, should never happen
 	if(new_f) cf = new_f;
@@ -1670,23 +1920,28 @@ void cssDocLoad(int frameNumber, char *start, bool pageload)
 		readShortCache(cm);
 	}
 // This could be run again and again, if the style nodes change.
-	if (cm->descriptors) {
+	if (cm->sheets) {
 		debugPrint(3,
 			   "free and recompile css descriptors due to dom changes");
-		cssPiecesFree(cm->descriptors);
+		sheetsFree(cm);
 		recompile = true;
 	}
-	if(pageload)
-		loadstring = initString(&loadstring_l);
-	cm->descriptors = cssPieces(start);
+	sheetsLoad(cm, start);
 	if(pageload) {
+		loadstring = initString(&loadstring_l);
+		for (i = 0; i < cm->numsheets; ++i)
+			stringAndString(&loadstring, &loadstring_l,
+					cm->sheets[i]->loadstring);
 		run_function_onestring_win(cf, "makeSheets", loadstring);
 		nzFree(loadstring);
 		loadstring = 0;
 	}
 	if (recompile)
 		debugPrint(3, "css complete");
-	if (!cm->descriptors)
+	for (i = 0; i < cm->numsheets; ++i)
+		if (cm->sheets[i]->descriptors)
+			break;
+	if (i == cm->numsheets)
 		goto done;
 	if (debugCSS) {
 		FILE *f = fopen(cssDebugFile, "ae");
@@ -1771,8 +2026,7 @@ void cssFree(Frame *f)
 	struct cssmaster *cm = f->cssmaster;
 	if (!cm)
 		return;
-	if (cm->descriptors)
-		cssPiecesFree(cm->descriptors);
+	sheetsFree(cm);
 	while ((c = cm->cache)) {
 		cm->cache = c->next;
 		nzFree(c->url);
@@ -2572,6 +2826,8 @@ onetime:
 		break;
 
 	case '>': // parentNode
+		if (bloomReject(t, a))
+			break;
 		t = t->parent;
 		if (!t || t->action == TAGACT_DOC)
 			break;
@@ -2580,6 +2836,8 @@ onetime:
 		goto onetime;
 
 	case ' ': // ancestor
+		if (bloomReject(t, a))
+			break;
 		while ((t = t->parent) && t->action != TAGACT_DOC) {
 			if (!qsaMatch(t, a))
 				continue;
@@ -2644,10 +2902,10 @@ static Tag **qsa1(const struct sel *sel, const char *selstring)
 	Tag *t;
 	Tag **a, **list;
 
-	list = bestListAtomic(sel->chain);
+	list = bestListAtomic(sel->chain, &i);
 	if (!onematch && list) {
 // allocate room for all, in case they all match.
-		for (n = 0; list[n]; ++n) ;
+		n = i;
 	}
 	a = allocMem((n + 1) * sizeof(Tag *));
 	if (!list) {
@@ -3122,6 +3380,7 @@ void cssApply(int frameNumber, Tag *t, int pe)
 	Frame *save_cf = cf;
 	struct cssmaster *cm;
 	struct desc *d;
+	int i;
 	Frame *new_f = frameFromWindow(frameNumber);
 // no clue what to do if new_f is null, should never happen
 	if(new_f) cf = new_f;
@@ -3140,9 +3399,11 @@ void cssApply(int frameNumber, Tag *t, int pe)
 	nzFree(t->id);
 	t->id = get_property_string_t(t, "id");
 
-	for (d = cm->descriptors; d; d = d->next) {
-		if (qsaMatchGroup(t, d))
-			do_rules(0, d->rules, d->highspec);
+	for (i = 0; i < cm->numsheets; ++i) {
+		for (d = cm->sheets[i]->descriptors; d; d = d->next) {
+			if (qsaMatchGroup(t, d))
+				do_rules(0, d->rules, d->highspec);
+		}
 	}
 
 done:
@@ -3344,12 +3605,157 @@ Just the indifidual words and the whole thing.
 	}
 	hashSortCrunch(&h, &j, true);
 	hashclasses = h, hashclasses_n = j;
+
+	bloomBuild();
+}
+
+/*********************************************************************
+Ancestor filters.
+A descendant selector like .sidebar a matches every <a> in the document,
+then marches up the tree looking for class sidebar,
+and usually marches all the way to <html> and finds nothing.
+Most of the selectors on a large site are of this form,
+and most of them fail, so the failing climb is where the time goes.
+Before we climb, we ask a little bloom filter on the node.
+It holds the tags, ids, and class words of every ancestor,
+so if sidebar isn't in the filter, it isn't above us, and we are done.
+The filter can say yes when the answer is no, hash collisions,
+but it never says no when the answer is yes,
+so the climb is still the last word.
+This is built alongside the hash tables for bulk matching,
+and indexed by seqno.
+Nodes outside the tree we walked, or created after we walked it,
+have a filter of all ones, and are never rejected.
+*********************************************************************/
+
+struct bloom {
+	unsigned long long b[2];
+};
+
+static struct bloom *ancBloom;
+static int ancBloom_n;
+
+static void bloomAdd(struct bloom *f, char type, const char *key)
+{
+	unsigned long long h = 14695981039346656037ULL;
+	int i;
+	h = (h ^ (uchar) type) * 1099511628211ULL;
+	for (; *key; ++key)
+		h = (h ^ (uchar) * key) * 1099511628211ULL;
+// two bits out of 128
+	i = h & 127;
+	f->b[i >> 6] |= 1ULL << (i & 63);
+	i = (h >> 7) & 127;
+	f->b[i >> 6] |= 1ULL << (i & 63);
+}
+
+static bool bloomHas(const struct bloom *f, char type, const char *key)
+{
+	struct bloom g = { {0, 0} };
+	bloomAdd(&g, type, key);
+	return (f->b[0] & g.b[0]) == g.b[0] && (f->b[1] & g.b[1]) == g.b[1];
+}
+
+// add the tag, id, and class words of t to the filter
+static void bloomAddNode(struct bloom *f, const Tag *t)
+{
+	static const char ws[] = " \t\r\n\f";	// white space
+	const char *s;
+	char *w;
+	int l;
+	if (t->nodeNameU)
+		bloomAdd(f, 'T', t->nodeNameU);
+	if (t->id && t->id[0])
+		bloomAdd(f, 'I', t->id);
+	if (!(s = t->jclass))
+		return;
+	while (*s) {
+		while (isspaceByte(*s))
+			++s;
+		if (!*s)
+			break;
+		l = strcspn(s, ws);
+		w = pullString(s, l);
+		bloomAdd(f, 'C', w);
+		nzFree(w);
+		s += l;
+	}
+}
+
+// recursive, t has the filter of its ancestors, pass it down to the children
+static void bloomBuild1(Tag *t, const struct bloom *f)
+{
+	struct bloom g;
+	Tag *u;
+	if (t->seqno >= 0 && t->seqno < ancBloom_n)
+		ancBloom[t->seqno] = *f;
+// can't descend into another frame
+	if (t->action == TAGACT_FRAME)
+		return;
+	g = *f;
+	bloomAddNode(&g, t);
+	for (u = t->firstchild; u; u = u->sibling)
+		bloomBuild1(u, &g);
+}
+
+static void bloomBuild2(Tag *top)
+{
+	struct bloom f = { {0, 0} };
+	Tag *u;
+	for (u = top->parent; u && u->action != TAGACT_DOC; u = u->parent)
+		bloomAddNode(&f, u);
+	bloomBuild1(top, &f);
+}
+
+static void bloomBuild(void)
+{
+	ancBloom_n = cw->numTags;
+	ancBloom = allocMem(ancBloom_n * sizeof(struct bloom) + 1);
+	memset(ancBloom, 0xff, ancBloom_n * sizeof(struct bloom));
+	if (cf->htmltag) {
+		bloomBuild2(cf->htmltag);
+	} else {
+		if (cf->headtag)
+			bloomBuild2(cf->headtag);
+		if (cf->bodytag)
+			bloomBuild2(cf->bodytag);
+	}
+}
+
+/*********************************************************************
+Can the atomic selector a match anything above t?
+Only the tag, and the class and id modifiers, are in the filter.
+Return true if something in a is certainly not above t.
+*********************************************************************/
+
+static bool bloomReject(const Tag *t, const struct asel *a)
+{
+	const struct bloom *f;
+	const struct mod *mod;
+	const char *p;
+	if (!bulkmatch || !ancBloom || t->seqno < 0 || t->seqno >= ancBloom_n)
+		return false;
+	f = ancBloom + t->seqno;
+	if (a->tag && !bloomHas(f, 'T', a->tag))
+		return true;
+	for (mod = a->modifiers; mod; mod = mod->next) {
+		p = mod->part;
+		if (mod->negate || !p[0])
+			continue;
+		if (mod->isclass && !bloomHas(f, 'C', p + 8))
+			return true;
+		if (mod->isid && !bloomHas(f, 'I', p + 4))
+			return true;
+	}
+	return false;
 }
 
 static void hashFree(void)
 {
 	struct hashhead *h;
 	int i;
+	nzFree(ancBloom);
+	ancBloom = 0, ancBloom_n = 0;
 	for (i = 0; i < hashtags_n; ++i) {
 		h = hashtags + i;
 		free(h->body);
@@ -3426,12 +3832,14 @@ static struct hashhead *findKey(struct hashhead *list, int n, const char *key)
 // This could be no list at all, if the selector includes .foo,
 // and there is no node of class foo.
 // Or it could be doclist if there is no tag and no class or id modifiers.
-static Tag **bestListAtomic(struct asel *a)
+// The length of the list is passed back, so we don't have to count it.
+static Tag **bestListAtomic(struct asel *a, int *np)
 {
 	struct mod *mod;
 	struct hashhead *h, *best_h;
 	int n, best_n = 0;
 
+	*np = doclist_n;
 	if (!bulkmatch)
 		return doclist;
 
@@ -3463,7 +3871,10 @@ static Tag **bestListAtomic(struct asel *a)
 		}
 	}
 
-	return (best_n ? best_h->body : doclist);
+	if (!best_n)
+		return doclist;
+	*np = best_n;
+	return best_h->body;
 }
 
 // Cross all selectors and all nodes at document load time.
@@ -3471,10 +3882,10 @@ static Tag **bestListAtomic(struct asel *a)
 static void cssEverybody(void)
 {
 	struct cssmaster *cm = cf->cssmaster;
-	struct desc *d0 = cm->descriptors, *d;
+	struct desc *d;
 	Tag **a, **u;
 	Tag *t;
-	int l;
+	int i, l;
 
 	bulkmatch = true;
 	bulktotal = 0;
@@ -3484,18 +3895,20 @@ static void cssEverybody(void)
 	for (l = 0; l < 6; ++l) {
 		matchhover = (l >= 3);
 		matchtype = l % 3;
-		for (d = d0; d; d = d->next) {
-			if (d->error)
-				continue;
-			a = qsa2(d, NULL);
-			if (!a)
-				continue;
-			for (u = a; (t = *u); ++u) {
-				if (!t->jslink)
+		for (i = 0; i < cm->numsheets; ++i) {
+			for (d = cm->sheets[i]->descriptors; d; d = d->next) {
+				if (d->error)
 					continue;
-				do_rules(t, d->rules, t->highspec);
+				a = qsa2(d, NULL);
+				if (!a)
+					continue;
+				for (u = a; (t = *u); ++u) {
+					if (!t->jslink)
+						continue;
+					do_rules(t, d->rules, t->highspec);
+				}
+				nzFree(a);
 			}
-			nzFree(a);
 		}
 	}
 	bulkmatch = false;
@@ -1320,7 +1320,7 @@ void sql_unfold(int start, int end, char action)
 			((start <= ln && end >= ln) ||
 			(start <= ln + nc && end >= ln + nc) ||
 			(start > ln && end < ln + nc))) {
-				free((char*)s);
+				freeLineText((pst)s);
 // how many pipes do we need to escape?
 				len2 = 0;
 				for(j = 1; j <= nc; ++j) {
@@ -1340,7 +1340,7 @@ void sql_unfold(int start, int end, char action)
 						*w++ = *s;
 					}
 					*w++ = '|';
-					free((char*)s0);
+					freeLineText((pst)s0);
 				}
 				w[-1] = '\n';
 				cw->dot = ln2;
@@ -1375,7 +1375,7 @@ void sql_unfold(int start, int end, char action)
 				newmap[ln2 + j].text = (pst)v;
 			}
 			ln2 += nc;
-			free((char*)s);
+			freeLineText((pst)s);
 		} else {
 // no change, just copy
 			newmap[ln2++].text = cw->map[ln].text;
@@ -65,6 +65,9 @@ extern char frameContent[];
 	extern const char startWindowJS[];
 	extern const char deminJS[];
 	extern const char sharedJS[];
+// precompiled bytecode of the above, length 0 if we must run the source
+	extern const unsigned char sharedBC[], startWindowBC[];
+	extern const int sharedBCLen, startWindowBCLen;
 // this is crude but it works.
 #define WithDebugging (strlen(deminJS) > 5000)
 
@@ -211,7 +214,12 @@ struct i_get {
 	bool is_http;
 	bool cacheable;
 	bool last_curlin;
+	bool setcookie; // Set-Cookie seen in this response
+	bool preload; // look ahead for scripts and css as the page comes in
+	int preload_off; // how far we have looked
+	char *preload_base; // <base href> if we have seen it
 	bool move_capable;
+	bool condstore; // imap server can tell us what changed
 	char error[CURL_ERROR_SIZE + 1];
 	long code;		/* example, 404 */
 /* an assortment of variables that are gleaned from the incoming http headers */
@@ -236,6 +244,7 @@ struct MACCOUNT { // email account, pop3 or imap
 	int inport, outport;
 	uchar inssl, outssl;
 	bool nofetch, imap, secure, maskon, maskactive, dxon, move_capable, mc_set;
+	bool condstore;
 	const char *cclist[MAXCC + 1]; // extra cc directives
 	uchar cctype[MAXCC]; // cc or bcc or attach
 	const char *isub; // substring of folders
@@ -369,6 +378,7 @@ extern char *cookieFile;	/* persistent cookies */
 extern char *cacheDir;	/* directory for a persistent cache of http pages */
 extern int cacheSize; // in megabytes
 extern int cacheCount; // number of cache files
+extern bool cacheZip; // compressed cache files, shared by content
 extern bool hlocal; // http local, read from cache only
 
 // General link list. This is, interestingly, the same design
@@ -461,6 +471,7 @@ struct ebWindow {
 	char *mailInfo;
 	char lhs[MAXRE], rhs[MAXRE];	/* remembered substitution strings */
 	struct lineMap *map, *r_map;
+	struct lineChunk *linechunk; // new lines are carved out of this chunk
 	char *dmap; // for directory listing
 /* The labels that you set with the k command, and access via 'x.
  * Basically, that's 26 line numbers.
@@ -601,6 +612,7 @@ struct htmlTag {
 	pthread_t loadthread;
 	long hcode;
 	bool loadsuccess;
+	char fetchstate; // background fetch, 1 queued 2 running 3 done
 	uchar step; // prerender, decorate, load script, runscript
 // the slash member was for the tag coresponding to <foo/>, the closing tag,
 // but we don't do that any more, just one tag for <foo> in the tree.
@@ -626,6 +638,7 @@ struct htmlTag {
 	bool post:1;		/* post, rather than get */
 	bool javapost:1;	// post by calling javascript
 	bool jslink:1;	// linked to a js object
+	bool dirty:1; // text changed by js since the last render
 	bool expf:1; // we tried to expand this frame
 	bool mime:1;		// encode as mime, rather than url encode
 	bool plain:1;		// do not encode, rather than url encode
@@ -16,6 +16,8 @@ void removeHiddenNumbers(pst p, uchar terminate, int cx, const Window *w);
 pst fetchLineWindow(int n, int show, const Window *w);
 pst fetchLineContext(int n, int show, int cx);
 pst fetchLine(int n, int show);
+pst borrowLineWindow(int n, const Window *w, int *len);
+void releaseLine(pst p, int n, const Window *w);
 void displayLine(int n);
 void printDot(void);
 void printPrompt(void);
@@ -25,6 +27,7 @@ pst inputLine(const bool textEntry);
 void saveSubstitutionStrings(void);
 void restoreSubstitutionStrings(Window *nw);
 Window *createWindow(void);
+void freeLineText(pst p);
 void freeWindowLines(struct lineMap *map);
 void undoCompare(void);
 void freeWindows(int cx, bool all);
@@ -193,6 +196,7 @@ void html_from_setter( Tag *innerParent, const char *h);
 
 // sourcefile=html-tags.c
 void htmlScanner(const char *htmltext, Tag *above, bool isgen);
+int htmlPreload(const char *s, int len, int off, const char *url, char **basep);
 void setTagAttr(Tag *t, const char *name, char *val);
 const char *attribVal(const Tag *t, const char *name);
 bool attribPresent(const Tag *t, const char *name);
@@ -221,6 +225,12 @@ bool httpConnect(struct i_get *g);
 void *httpConnectBack1(void *ptr);
 void *httpConnectBack2(void *ptr);
 void *httpConnectBack3(void *ptr);
+void fetchQueue(Tag *t, bool xhr);
+bool fetchDone(Tag *t, bool wait);
+void fetchCancel(Tag *t);
+void preloadStart(const char *url, const char *from);
+bool httpConnectPreload(struct i_get *g);
+void preloadDrop(const Frame *f);
 void ebcurl_setError(CURLcode curlret, const char *url, int action, const char *curl_error);
 int ftpWrite(const char *url);
 void setHTTPLanguage(const char *lang);
@@ -404,6 +414,7 @@ bool frameSecurityFile(const char *thisfile);
 bool receiveCookie(const char *url, const char *str) ;
 void cookiesFromJar(void) ;
 bool isInDomain(const char *d, const char *s);
+void cookiesChanged(void);
 void findcookies(char **s, int *l, const char *url, bool issecure) ;
 void mergeCookies(void);
 void setupEdbrowseCache(void);
@@ -411,6 +422,9 @@ void clearCache(void) ;
 bool fetchCache(const char * url, const char *etag, time_t modtime, bool grab, char **data, int *data_len) ;
 bool presentInCache(const char *url, bool *recent) ;
 void storeCache(const char *url, const char *etag, time_t modtime, const char *data, int datalen) ;
+char *jsCacheFile(const char *source);
+bool jsCacheFetch(const char *file, const char *stamp, char **data, int *len);
+void jsCacheStore(const char *file, const char *stamp, const char *data, int len);
 bool getUserPass(const char *url, char *creds, bool find_proxy) ;
 bool getUserPassRealm(const char *url, char *creds, const char *realm);
 // Add authorization entries only in the foreground, but it's an
@@ -459,6 +473,7 @@ void my_ExecutePendingMessagePorts(void);
 void delPendings(const Frame *f);
 void js_main(void);
 void createJSContext(Frame *f);
+bool jsPoolFill(void);
 void freeJSContext(Frame *f);
 void run_ontimer(const Frame *f, const char *backlink);
 int run_function_onearg_t(const Tag *t, const char *name, const Tag *t2);
@@ -474,6 +489,7 @@ bool run_event_win(const Frame *f, const char *pname, const char *evname);
 bool run_event_doc(const Frame *f, const char *pname, const char *evname);
 bool bubble_event_t(const Tag *t, const char *name);
 void set_property_bool_win(const Frame *f, const char *name, bool v);
+void dirtyText(const Frame *f);
 void set_property_bool_doc(const Frame *f, const char *name, bool v);
 char *get_property_url_t(const Tag *t, bool action);
 char *get_style_string_t(const Tag *t, const char *name);
@@ -6,6 +6,8 @@
 
 #include "eb.h"
 
+#include <dirent.h>
+
 #define MHLINE 512		// length of a mail header line
 // headers and other information about an email
 struct MHINFO {
@@ -221,7 +223,7 @@ static void linkAttachments(struct MHINFO *w)
 /* string to hold the returned data from the mail server */
 static char *mailstring;
 static int mailstring_l;
-static char *mailbox_url, *message_url;
+static char *mailbox_url;
 
 static int fetchLimit = 100;
 static const char envelopeFormatChars[8] = "tfsdznu";
@@ -306,8 +308,13 @@ static struct FOLDER {
 	int unread;		/* how many not yet seen */
 	int start;
 	int uidnext;		/* uid of next message */
+	int uidvalidity;
+	unsigned long long modseq;	/* highest modseq, if condstore */
+	bool synced;		/* just selected, counts are current */
 	struct MIF *mlist;	/* allocated */
 	char *cbase; // allocated
+	char **cbmore;		// cbase for the later pages of a search
+	int cbmore_n;
 } *topfolders;
 
 static struct MACCOUNT *active_a;
@@ -575,17 +582,20 @@ static CURLcode getMailData(CURL * h)
 //  puts("get data");
 	cerror[0] = 0;
 	callback_data.buffer = initString(&callback_data.length);
-	callback_data.move_capable = false;
+	callback_data.move_capable = callback_data.condstore = false;
 	res = curl_easy_perform(h);
 	mailstring = callback_data.buffer;
 	mailstring_l = callback_data.length;
 	callback_data.buffer = 0;
 	if (!active_a->mc_set) {
 		active_a->move_capable = callback_data.move_capable;
+		active_a->condstore = callback_data.condstore;
 		if (debugLevel < 4)
 			curl_easy_setopt(h, CURLOPT_VERBOSE, 0);
 		debugPrint(3, "imap is %smove capable",
 			   (active_a->move_capable ? "" : "not "));
+		debugPrint(3, "imap is %scondstore capable",
+			   (active_a->condstore ? "" : "not "));
 		active_a->mc_set = true;
 	}
 	return res;
@@ -620,49 +630,133 @@ static size_t imap_null_callback(char *i, size_t size,
 	return b;
 }
 
-/* after the email has been fetched via pop3 or imap */
-static void undosOneMessage(void)
+/* Remove DOS newlines, returns the new length. */
+static int undosString(char *s, int l)
 {
 	int j, k;
+	for (j = k = 0; j < l; j++) {
+		if (s[j] == '\r' && j < l - 1 && s[j + 1] == '\n')
+			continue;
+		s[k++] = s[j];
+	}
+	s[k] = 0;
+	return k;
+}
 
+/* after the email has been fetched via pop3 or imap */
+static void undosOneMessage(void)
+{
 	if (mailstring_l >= CHUNKSIZE)
 		nl();		/* We printed dots, so we terminate them with newline */
-
-/* Remove DOS newlines. */
-	for (j = k = 0; j < mailstring_l; j++) {
-		if (mailstring[j] == '\r' && j < mailstring_l - 1
-		    && mailstring[j + 1] == '\n')
-			continue;
-		mailstring[k++] = mailstring[j];
-	}
-	mailstring_l = k;
-	mailstring[k] = 0;
+	mailstring_l = undosString(mailstring, mailstring_l);
 }
 
 static char presentMail(bool *plain);
-static bool envelopes(CURL * handle, struct FOLDER *f);
+struct mailCache;
+static bool envelopes(CURL * handle, struct FOLDER *f,
+		      struct mailCache *mc0, CURLcode *res_p);
+static struct mailCache *mailCacheLoad(const struct FOLDER *f);
+static void mailCacheSave(struct mailCache *mc, const struct FOLDER *f,
+			  bool keepseq);
+static void mailCacheFree(struct mailCache *mc);
+static void mailCacheForget(const char *path, const int *uids, int n);
 static void isoDecode(char *vl, char **vrp);
 
 static void cleanFolder(struct FOLDER *f)
 {
+	int i;
 	nzFree(f->cbase), f->cbase = NULL;
+	for (i = 0; i < f->cbmore_n; ++i)
+		nzFree(f->cbmore[i]);
+	nzFree(f->cbmore), f->cbmore = NULL;
+	f->cbmore_n = 0;
 	nzFree(f->mlist), f->mlist = NULL;
 	f->nmsgs = f->nfetch = f->unread = 0;
+	f->modseq = 0, f->synced = false;
+}
+
+/*********************************************************************
+The search response can be very long, 20 thousand sequence numbers
+if the search is broad, so parse it as it comes in,
+rather than gathering it into a string and then picking through it.
+The numbers follow * SEARCH on one line; other lines are skipped.
+*********************************************************************/
+
+struct searchState {
+	int *list;
+	int count, room;
+	int num;		// number being read, -1 if none
+	int match;		// how much of * SEARCH we have seen on this line
+	uchar state;		// 0 start of line, 1 skipping a line, 2 in the list
+};
+
+static size_t search_callback(char *i, size_t size, size_t nitems, void *data)
+{
+	static const char prefix[] = "* SEARCH";
+	struct searchState *ss = data;
+	size_t b = size * nitems, k;
+	char c;
+	for (k = 0; k < b; ++k) {
+		c = i[k];
+		if (ss->state == 0) {
+			if (c == prefix[ss->match]) {
+				if (++ss->match == sizeof(prefix) - 1)
+					ss->state = 2, ss->num = -1;
+				continue;
+			}
+			ss->state = 1;
+		}
+		if (ss->state == 1) {
+			if (c == '\n')
+				ss->state = 0, ss->match = 0;
+			continue;
+		}
+		if (isdigitByte(c)) {
+			ss->num = (ss->num < 0 ? 0 : ss->num * 10) + c - '0';
+			continue;
+		}
+		if (ss->num >= 0) {
+			if (ss->count == ss->room) {
+				ss->room = (ss->room ? ss->room * 2 : 1024);
+				ss->list = (ss->list ?
+					    reallocMem(ss->list, ss->room * sizeof(int)) :
+					    allocMem(ss->room * sizeof(int)));
+			}
+			ss->list[ss->count++] = ss->num;
+			ss->num = -1;
+		}
+		if (c == '\n')
+			ss->state = 0, ss->match = 0;
+	}
+	return b;
 }
 
-// search through imap server for a particular string.
-// Return 1 if the search ran successfully and found some messages.
-// Return 0 for no messages and -1 for error.
+/*********************************************************************
+search through imap server for a particular string.
+Return 1 if the search ran successfully and found some messages.
+Return 0 for no messages and -1 for error.
+Envelopes are fetched SEARCHPAGE at a time, and pagefn, if given,
+is called after each page, so the caller can show what we have so far.
+The imap cache is loaded once, used by every page, and saved at the end.
+An interrupt stops the paging, and we keep the pages we have.
+If the first page fails, *res_p says why.
+*********************************************************************/
+
+#define SEARCHPAGE 50
+
 static int imapSearch(CURL * handle, struct FOLDER *f, char *line,
-	bool unseen, CURLcode *res_p)
+	bool unseen, CURLcode *res_p,
+	void (*pagefn)(const struct FOLDER *f, int from, int n))
 {
 	char searchtype = 0;
-	char *t, *u;
 	CURLcode res;
-	int cnt;
+	int cnt, j, k, n;
 	int fl = (ismc ? fetchLimit : cw->imap_l);
 	bool earliest = false;
 	struct MIF *mif;
+	struct FOLDER page;
+	struct searchState ss;
+	struct mailCache *mc;
 	char cust_cmd[240];
 
 	if(fl < 0) earliest = true, fl = -fl;
@@ -705,31 +799,26 @@ static int imapSearch(CURL * handle, struct FOLDER *f, char *line,
 		strcat(cust_cmd, "\"");
 	}
 	curl_easy_setopt(handle, CURLOPT_CUSTOMREQUEST, cust_cmd);
-	res = getMailData(handle);
+	memset(&ss, 0, sizeof(ss));
+	curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, search_callback);
+	curl_easy_setopt(handle, CURLOPT_WRITEDATA, &ss);
+	cerror[0] = 0;
+	res = curl_easy_perform(handle);
+// and put things back
+	curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, eb_curl_callback);
+	curl_easy_setopt(handle, CURLOPT_WRITEDATA, &callback_data);
 	if (res != CURLE_OK) {
 		*res_p = res;
-		nzFree(mailstring), mailstring = 0;
+		nzFree(ss.list);
 		return -1;
 	}
 
-	t = strstr(mailstring, "SEARCH ");
-	if (!t) {
-none:
-		nzFree(mailstring), mailstring = 0;
+	cnt = ss.count;
+	if (!cnt) {
 		if(ismc) i_puts(MSG_NoMatch); else setError(MSG_NoMatch);
 		return 0;
 	}
-	t += 6;
-	cnt = 0;
-	while (*t == ' ') ++t;
-	u = t;
-	while (*u) {
-		if (!isdigitByte(*u)) break;
-		++cnt;
-		while (isdigitByte(*u)) ++u;
-		skipWhite2(&u);
-	}
-	if (!cnt) goto none;
+	debugPrint(3, "%d found", cnt);
 
 	cleanFolder(f);
 
@@ -737,21 +826,53 @@ none:
 	if (cnt > fl)
 		f->nfetch = fl;
 	f->mlist = allocZeroMem(sizeof(struct MIF) * f->nfetch);
-	mif = f->mlist;
-	u = t;
-	while (*u && cnt) {
-		int seqno = strtol(u, &u, 10);
-		if ((!earliest && cnt <= f->nfetch) ||
-		(earliest && mif - f->mlist < f->nfetch)) {
-			mif->seqno = seqno;
-			++mif;
+	j = (earliest ? 0 : cnt - f->nfetch);
+	for (k = 0; k < f->nfetch; ++k)
+		f->mlist[k].seqno = ss.list[j + k];
+	nzFree(ss.list);
+
+	mc = mailCacheLoad(f);
+	for (k = 0; k < f->nfetch; k += n) {
+		if (k && intFlag) {
+			i_puts(MSG_Interrupted);
+			break;
+		}
+		n = f->nfetch - k;
+		if (n > SEARCHPAGE)
+			n = SEARCHPAGE;
+		page = *f;
+		page.mlist = f->mlist + k;
+		page.nfetch = n;
+		page.start = page.mlist->seqno;
+		page.cbase = 0, page.unread = 0;
+		if (!envelopes(handle, &page, mc, &res))
+			break;
+		if (!f->cbase) {
+			f->cbase = page.cbase;
+		} else {
+			f->cbmore = (f->cbmore ?
+				     reallocMem(f->cbmore, (f->cbmore_n + 1) * sizeof(char *)) :
+				     allocMem(sizeof(char *)));
+			f->cbmore[f->cbmore_n++] = page.cbase;
 		}
-		--cnt;
-		skipWhite2(&u);
+		f->unread += page.unread;
+		for (j = 0, mif = page.mlist; j < n; ++j, ++mif)
+			mif->startlist = f->mlist;
+		if (pagefn)
+			(*pagefn)(f, k, n);
 	}
 
-	envelopes(handle, f);
+	if (mc) {
+		mailCacheSave(mc, f, false);
+		mailCacheFree(mc);
+	}
 
+// keep what we have, if we were interrupted, or a page failed
+	f->nfetch = k;
+	if (!k) {
+		*res_p = res;
+		return -1;
+	}
 	return 1;
 }
 
@@ -844,7 +965,8 @@ static bool bulkMoveDelete(CURL * handle, struct FOLDER *f,
 	int j;
 	struct MIF *mif = f->mlist;
 	char *t, *fromline = 0;
-	bool deleted = false;
+	bool deleted = false, rc = false;
+	int *uids, n = 0;
 
 	if (key == 'f') {
 		fromline = this_mif->from;
@@ -854,6 +976,7 @@ static bool bulkMoveDelete(CURL * handle, struct FOLDER *f,
 		}
 	}
 
+	uids = allocMem(f->nfetch * sizeof(int));
 	for (j = 0; j < f->nfetch; ++j, ++mif) {
 		bool delflag = false;
 		if (mif->gone)
@@ -870,8 +993,10 @@ static bool bulkMoveDelete(CURL * handle, struct FOLDER *f,
 			nzFree(mailstring), mailstring = 0;
 			if (res != CURLE_OK)
 				goto abort;
-			if (active_a->move_capable) mif->gone = true;
-			else delflag = true;
+			if (active_a->move_capable) {
+				mif->gone = true;
+				uids[n++] = mif->uid;
+			} else delflag = true;
 		}
 
 		if (subkey == 'd' || delflag) {
@@ -883,14 +1008,17 @@ static bool bulkMoveDelete(CURL * handle, struct FOLDER *f,
 				goto abort;
 			deleted = true;
 			mif->gone = true;
+			uids[n++] = mif->uid;
 		}
 	}
 
 	if(deleted && !expunge(handle)) goto abort;
-	return true;
+	rc = true;
 
 abort:
-	return false;
+	mailCacheForget(f->path, uids, n);
+	free(uids);
+	return rc;
 }
 
 // go back into a folder after a disconnect and reconnect
@@ -922,41 +1050,1345 @@ static bool refolder(CURL *h, struct FOLDER *f, CURLcode res1)
 // If no good after the second attempt, set the curl error and return false.
 static bool tryTwice(CURL *h, const char *path, const char *cmd)
 {
-	struct FOLDER f0;
-	memset(&f0, 0, sizeof(f0));
-	f0.path = path;
+	struct FOLDER f0;
+	memset(&f0, 0, sizeof(f0));
+	f0.path = path;
+	CURLcode res;
+	bool retry = false;
+
+	curl_easy_setopt(h, CURLOPT_VERBOSE, (debugLevel >= 4));
+
+again:
+	curl_easy_setopt(h, CURLOPT_CUSTOMREQUEST, cmd);
+	res = getMailData(h);
+	nzFree(mailstring), mailstring = 0;
+	if (res != CURLE_OK) {
+		if(retry || !refolder(h, &f0, res))
+			goto abort;
+		retry = true;
+		goto again;
+	}
+return true;
+
+abort:
+	ebcurl_setError(res, cf->firstURL, 0, cerror);
+	return false;
+}
+
+/*********************************************************************
+A fetch response is a parenthesized list, and the server
+can put the items in any order.
+fetchScan walks the list, stepping over quoted strings and {n} literals,
+lest a subject with UID in it fool us,
+and returns a pointer just past the named item at the top level,
+or, if item is null, to the closing paren of the list.
+*********************************************************************/
+
+static char *fetchScan(const char *s, const char *item)
+{
+	int depth = 0, n, l = (item ? strlen(item) : 0);
+	char *u;
+	s = strchr(s, '(');
+	if (!s)
+		return 0;
+	for (; *s; ++s) {
+		if (*s == '"') {
+			for (++s; *s && *s != '"'; ++s)
+				if (*s == '\\' && s[1])
+					++s;
+			if (!*s)
+				break;
+			continue;
+		}
+		if (*s == '{') {
+			n = strtol(s + 1, &u, 10);
+			if (*u != '}')
+				continue;
+			s = u + 1;
+			while (*s == '\r' || *s == '\n')
+				++s;
+			if (n < 0 || n > (int)strlen(s))
+				break;
+			s += n - 1;
+			continue;
+		}
+		if (*s == '(') {
+			++depth;
+			continue;
+		}
+		if (*s == ')') {
+			if (--depth == 0)
+				return (item ? 0 : (char *)s);
+			continue;
+		}
+		if (item && depth == 1 && !strncmp(s, item, l) &&
+		    (s[-1] == ' ' || s[-1] == '('))
+			return (char *)s + l;
+	}
+	return 0;
+}
+
+static int fetchUid(const char *s)
+{
+	const char *u = fetchScan(s, "UID ");
+	return (u ? atoi(u) : 0);
+}
+
+static bool fetchSeen(const char *s)
+{
+	const char *u = fetchScan(s, "FLAGS (");
+	if (!u)
+		return false;
+	for (; *u && *u != ')'; ++u)
+		if (!strncmp(u, "\\Seen", 5))
+			return true;
+	return false;
+}
+
+// Find the next * n FETCH (...) in s, return the sequence number
+// and the start of the list, and a pointer past the end of the list.
+static char *nextFetch(char *s, int *seqno, char **start)
+{
+	char *t, *u;
+	int n;
+	while ((s = strstr(s, "* "))) {
+		t = s + 2;
+		s = t;
+		if (!isdigitByte(*t))
+			continue;
+		n = strtol(t, &t, 10);
+		if (strncmp(t, " FETCH (", 8))
+			continue;
+		t += 7;
+		u = fetchScan(t, 0);
+		if (!u)
+			return 0;
+		*seqno = n, *start = t;
+		return u + 1;
+	}
+	return 0;
+}
+
+/*********************************************************************
+Originally I used the WRITEFUNCTION to get the envelope data.
+That returns the untagged line, and that was right 99% of the time.
+That held the entire envelope.
+But once in a while the envelope continued on the next line,
+the body line, the other line, whatever you call it.
+For that eventuality I have to use the HEADERFUNCTION as well.
+Both do the same thing, the same function, gather data.
+But now I get the untagged line twice.
+I need to use the header function without the write function.
+If I leave the write function null, curl core dumps.
+I have to use a stub function. You'll see below.
+*********************************************************************/
+
+static CURLcode getEnvelopeData(CURL * handle, const char *cmd)
+{
+	CURLcode res;
+	curl_easy_setopt(handle, CURLOPT_CUSTOMREQUEST, cmd);
+	curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, eb_curl_callback);
+	curl_easy_setopt(handle, CURLOPT_HEADERDATA, &callback_data);
+	curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, imap_null_callback);
+	res = getMailData(handle);
+// and put things back
+	curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, eb_curl_callback);
+	curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, NULL);
+	curl_easy_setopt(handle, CURLOPT_HEADERDATA, NULL);
+	return res;
+}
+
+/*********************************************************************
+The imap cache.
+Descending into a folder fetched every envelope, every time,
+and every email you read came down again.
+Now envelopes and bodies are kept in cacheDir/imap,
+with a directory for each account, and within that, for each folder.
+The index file holds, for each uid, its sequence number when last seen,
+the seen flag, and the fetch response for its envelope, as the server sent it.
+Bodies are in files named by uid.
+None of this means anything if UIDVALIDITY changes,
+in which case the directory is emptied and we start over.
+If the server speaks CONDSTORE, and the highest mod sequence,
+the message count, and the next uid are what they were last time,
+nothing has changed, and the envelopes come right out of the cache;
+the SELECT is the only round trip.
+Otherwise we fetch uid and flags for the messages in view, which is small,
+then envelopes for the uids we don't have, usually the new mail at the end.
+Either way the responses are pasted together with the current
+sequence numbers, and envelopes() parses them as though they came
+from the server.
+QRESYNC would tell us which messages were expunged, but it has to be
+enabled on the connection, and curl may reconnect under us without a word,
+so the uid sweep does that job; a cached uid that falls between
+the uids of the sweep, and isn't one of them, is gone.
+A message that we delete or move is dropped from the cache right away,
+see mailCacheForget().
+The cache holds MAILCACHEMSGS messages per folder, the lowest uids go first,
+and bodies larger than MAILCACHEBODY are not kept.
+The imap directory as a whole gets 1/MAILCACHESHARE of cachesize;
+past that, the bodies read longest ago are removed.
+cachesize = 0 turns this off, as it does the web cache.
+*********************************************************************/
+
+#define MAILCACHEMSGS 5000
+#define MAILCACHEBODY 10000000
+#define MAILCACHESHARE 4
+#define MAILCACHESTAMP "ebimap1"
+
+struct mcEntry {
+	int uid, seqno;
+	bool seen, fresh;
+	bool gone;		// expunged, drop it on save
+	char *chunk;		// fetch response for the envelope
+};
+
+struct mailCache {
+	char *dir;
+	int uidvalidity, exists, uidnext;
+	unsigned long long modseq;
+	struct mcEntry *list;
+	int n, room;
+	bool sorted;
+};
+
+// account and folder names can hold anything, encode them for the filesystem
+static void mcEscape(char **s, int *l, const char *name)
+{
+	char hex[4];
+	uchar c;
+	const char *start = name;
+	for (; (c = *name); ++name) {
+		if (isalnumByte(c) || c == '@' || c == '_' || c == '-' ||
+		    (c == '.' && name > start)) {
+			stringAndChar(s, l, c);
+			continue;
+		}
+		sprintf(hex, "%%%02X", c);
+		stringAndString(s, l, hex);
+	}
+}
+
+static bool mcMkdir(const char *dir)
+{
+	return fileTypeByName(dir, 0) == 'd' || !mkdir(dir, 0700);
+}
+
+// The cache directory for this folder, allocated, or null if no cache.
+static char *mailCacheDir(const char *path)
+{
+	static bool tried;
+	char *dir;
+	int l;
+	if (!cacheDir && !tried) {
+// the mail client doesn't set up the cache
+		tried = true;
+		setupEdbrowseCache();
+	}
+	if (!cacheDir || !cacheSize || !path)
+		return 0;
+	dir = initString(&l);
+	stringAndString(&dir, &l, cacheDir);
+	stringAndString(&dir, &l, "/imap");
+	if (!mcMkdir(dir))
+		goto fail;
+	stringAndChar(&dir, &l, '/');
+	mcEscape(&dir, &l, active_a->login);
+	stringAndChar(&dir, &l, '@');
+	mcEscape(&dir, &l, active_a->inurl);
+	if (!mcMkdir(dir))
+		goto fail;
+	stringAndChar(&dir, &l, '/');
+	mcEscape(&dir, &l, path);
+	if (!mcMkdir(dir))
+		goto fail;
+	return dir;
+fail:
+	nzFree(dir);
+	return 0;
+}
+
+// read a cache file into memory, null terminated
+static char *mcRead(const char *file, int *lp)
+{
+	struct stat st;
+	int fh, n;
+	char *buf;
+	fh = open(file, O_RDONLY | O_BINARY | O_CLOEXEC);
+	if (fh < 0)
+		return 0;
+	if (fstat(fh, &st)) {
+		close(fh);
+		return 0;
+	}
+	n = st.st_size;
+	buf = allocMem(n + 1);
+	if (read(fh, buf, n) != n) {
+		close(fh);
+		free(buf);
+		return 0;
+	}
+	close(fh);
+	buf[n] = 0;
+	*lp = n;
+	return buf;
+}
+
+// write a cache file, by way of a temp file, so a reader never sees half of it
+static void mcWrite(const char *file, const char *data, int len)
+{
+	char *temp;
+	int fh;
+	bool ok;
+	ignore = asprintf(&temp, "%s.%d", file, getpid());
+	fh = open(temp, O_CREAT | O_TRUNC | O_WRONLY | O_BINARY | O_CLOEXEC, MODE_private);
+	if (fh < 0) {
+		free(temp);
+		return;
+	}
+	ok = (write(fh, data, len) == len);
+	close(fh);
+	if (!ok || rename(temp, file))
+		unlink(temp);
+	free(temp);
+}
+
+// bytes in the imap directory, or -1 if we haven't counted them yet
+static long long mcBytes = -1;
+
+static void mcUnlink(const char *file)
+{
+	struct stat st;
+	if (stat(file, &st))
+		return;
+	if (!unlink(file) && mcBytes >= 0)
+		mcBytes -= st.st_size;
+}
+
+static void mcWipe(const char *dir)
+{
+	const char *name;
+	char *file;
+	while ((name = nextScanFile(dir))) {
+		ignore = asprintf(&file, "%s/%s", dir, name);
+		mcUnlink(file);
+		free(file);
+	}
+}
+
+struct mcFile {
+	char *file;
+	time_t when;
+	off_t size;
+};
+
+static int mcfile_cmp(const void *s, const void *t)
+{
+	const struct mcFile *a = s, *b = t;
+	return (a->when < b->when ? -1 : a->when > b->when);
+}
+
+/*********************************************************************
+Walk the imap directory: accounts, then folders, then files.
+Add up the bytes, and if list is given, gather the bodies,
+with the time they were last read or written.
+nextScanFile() can't nest, so this uses readdir directly.
+*********************************************************************/
+
+static void mcWalk(const char *dir, int depth, struct mcFile **list,
+		   int *n, int *room, long long *total)
+{
+	DIR *df = opendir(dir);
+	struct dirent *de;
+	struct stat st;
+	char *file;
+	if (!df)
+		return;
+	while ((de = readdir(df))) {
+		if (de->d_name[0] == '.')
+			continue;
+		ignore = asprintf(&file, "%s/%s", dir, de->d_name);
+		if (lstat(file, &st)) {
+			free(file);
+			continue;
+		}
+		if (S_ISDIR(st.st_mode) && depth < 2) {
+			mcWalk(file, depth + 1, list, n, room, total);
+			free(file);
+			continue;
+		}
+		if (!S_ISREG(st.st_mode)) {
+			free(file);
+			continue;
+		}
+		*total += st.st_size;
+		if (!list || depth < 2 || !isdigitByte(de->d_name[0])) {
+			free(file);
+			continue;
+		}
+		if (*n == *room) {
+			*room = (*room ? *room * 2 : 256);
+			*list = (*list ?
+				 reallocMem(*list, *room * sizeof(struct mcFile)) :
+				 allocMem(*room * sizeof(struct mcFile)));
+		}
+		(*list)[*n].file = file;
+		(*list)[*n].when = (st.st_atime > st.st_mtime ? st.st_atime : st.st_mtime);
+		(*list)[*n].size = st.st_size;
+		++*n;
+	}
+	closedir(df);
+}
+
+// Hold the imap directory to its share of cachesize.
+static void mcBudget(void)
+{
+	long long limit = (long long)cacheSize * 1024 * 1024 / MAILCACHESHARE;
+	struct mcFile *list = 0;
+	int i, n = 0, room = 0;
+	char *dir;
+
+	if (mcBytes >= 0 && mcBytes <= limit)
+		return;
+	ignore = asprintf(&dir, "%s/imap", cacheDir);
+	if (mcBytes < 0) {
+		mcBytes = 0;
+		mcWalk(dir, 0, 0, 0, 0, &mcBytes);
+		if (mcBytes <= limit)
+			goto done;
+	}
+	mcBytes = 0;
+	mcWalk(dir, 0, &list, &n, &room, &mcBytes);
+	qsort(list, n, sizeof(struct mcFile), mcfile_cmp);
+// down to 90%, so we aren't pruning every time
+	for (i = 0; i < n && mcBytes > limit - limit / 10; ++i)
+		if (!unlink(list[i].file))
+			mcBytes -= list[i].size;
+	debugPrint(3, "imap cache is full; removing %d bodies", i);
+	for (i = 0; i < n; ++i)
+		free(list[i].file);
+	nzFree(list);
+done:
+	free(dir);
+}
+
+static int mc_cmp(const void *s, const void *t)
+{
+	const struct mcEntry *a = s, *b = t;
+	return (a->uid < b->uid ? -1 : a->uid > b->uid);
+}
+
+static struct mcEntry *mcFind(struct mailCache *mc, int uid)
+{
+	struct mcEntry key;
+	if (!mc->sorted) {
+		qsort(mc->list, mc->n, sizeof(struct mcEntry), mc_cmp);
+		mc->sorted = true;
+	}
+	key.uid = uid;
+	return bsearch(&key, mc->list, mc->n, sizeof(struct mcEntry), mc_cmp);
+}
+
+// the entry for this uid, made if need be; good until the next mcAdd
+static struct mcEntry *mcAdd(struct mailCache *mc, int uid)
+{
+	struct mcEntry *e = mcFind(mc, uid);
+	if (e)
+		return e;
+	if (mc->n == mc->room) {
+		mc->room = (mc->room ? mc->room * 2 : 256);
+		mc->list = (mc->list ?
+			    reallocMem(mc->list, mc->room * sizeof(struct mcEntry)) :
+			    allocMem(mc->room * sizeof(struct mcEntry)));
+	}
+	e = mc->list + mc->n++;
+	memset(e, 0, sizeof(struct mcEntry));
+	e->uid = uid;
+	if (mc->n > 1 && e[-1].uid > uid)
+		mc->sorted = false;
+	return e;
+}
+
+// Remember the fetch response for this message, starting at * n FETCH (
+static void mcNote(struct mailCache *mc, const struct MIF *mif, const char *s)
+{
+	struct mcEntry *e;
+	char *start = strstr(s, " FETCH ("), *end;
+	if (!mif->uid || !start)
+		return;
+	start += 7;
+	end = fetchScan(start, 0);
+	if (!end)
+		return;
+	e = mcAdd(mc, mif->uid);
+	nzFree(e->chunk);
+	e->chunk = pullString(start, end + 1 - start);
+	e->seen = fetchSeen(start);
+	e->seqno = mif->seqno;
+	e->fresh = true;
+}
+
+static void mailCacheFree(struct mailCache *mc)
+{
+	int i;
+	if (!mc)
+		return;
+	for (i = 0; i < mc->n; ++i)
+		nzFree(mc->list[i].chunk);
+	nzFree(mc->list);
+	nzFree(mc->dir);
+	free(mc);
+}
+
+// Load the cache for this folder; it may be empty. Null if no cache.
+static struct mailCache *mailCacheLoad(const struct FOLDER *f)
+{
+	struct mailCache *mc;
+	struct mcEntry *e;
+	char *dir, *file, *buf, *p, *end;
+	int l, v, uid, seqno, seen, len;
+
+	if (!f->uidvalidity || !(dir = mailCacheDir(f->path)))
+		return 0;
+	mc = allocZeroMem(sizeof(struct mailCache));
+	mc->dir = dir;
+	mc->uidvalidity = f->uidvalidity;
+	mc->sorted = true;
+	ignore = asprintf(&file, "%s/index", dir);
+	buf = mcRead(file, &l);
+	free(file);
+	if (!buf)
+		return mc;
+	if (sscanf(buf, MAILCACHESTAMP " %d %llu %d %d", &v, &mc->modseq,
+		   &mc->exists, &mc->uidnext) != 4 || v != f->uidvalidity ||
+	    !(p = strchr(buf, '\n'))) {
+		debugPrint(3, "imap cache for %s is stale", withoutSubstring(f));
+		mc->modseq = mc->exists = mc->uidnext = 0;
+		free(buf);
+		mcWipe(dir);
+		return mc;
+	}
+
+	end = buf + l;
+	for (++p; p < end; p += len + 1) {
+		uid = strtol(p, &p, 10);
+		seqno = strtol(p, &p, 10);
+		seen = strtol(p, &p, 10);
+		len = strtol(p, &p, 10);
+		if (*p != '\n' || uid <= 0 || len < 0 || ++p + len > end)
+			break;
+		e = mcAdd(mc, uid);
+		e->seqno = seqno, e->seen = seen;
+		e->chunk = pullString(p, len);
+	}
+	free(buf);
+	debugPrint(3, "imap cache for %s has %d envelopes", withoutSubstring(f), mc->n);
+	return mc;
+}
+
+/*********************************************************************
+Write the index back out.
+The sequence numbers of messages we didn't see this time are only
+good if nothing has changed; keepseq says so.
+If the folder was not just selected, as after a search,
+we don't know that the counts are current, so clear modseq,
+and the next descent does the uid sweep.
+*********************************************************************/
+
+static void mailCacheSave(struct mailCache *mc, const struct FOLDER *f,
+			  bool keepseq)
+{
+	struct mcEntry *e;
+	char *buf, *file;
+	int l, i, j, drop;
+
+	if (f->synced) {
+		mc->modseq = f->modseq;
+		mc->exists = f->nmsgs;
+		mc->uidnext = f->uidnext;
+	} else
+		mc->modseq = 0;
+	mcFind(mc, 0);		// sort
+
+// keep 90%, so we aren't pruning every time
+	drop = (mc->n > MAILCACHEMSGS ? mc->n - MAILCACHEMSGS * 9 / 10 : 0);
+	for (i = j = 0; i < mc->n; ++i) {
+		e = mc->list + i;
+		if (e->gone || (drop && !e->fresh)) {
+			ignore = asprintf(&file, "%s/%d", mc->dir, e->uid);
+			mcUnlink(file);
+			free(file);
+			nzFree(e->chunk);
+			if (!e->gone)
+				--drop;
+			continue;
+		}
+		if (!e->fresh && !keepseq)
+			e->seqno = 0;
+		mc->list[j++] = *e;
+	}
+	mc->n = j;
+
+	buf = initString(&l);
+	stringAndString(&buf, &l, MAILCACHESTAMP " ");
+	stringAndNum(&buf, &l, mc->uidvalidity);
+	{
+		char n[24];
+		sprintf(n, " %llu ", mc->modseq);
+		stringAndString(&buf, &l, n);
+	}
+	stringAndNum(&buf, &l, mc->exists);
+	stringAndChar(&buf, &l, ' ');
+	stringAndNum(&buf, &l, mc->uidnext);
+	stringAndChar(&buf, &l, '\n');
+	for (i = 0; i < mc->n; ++i) {
+		e = mc->list + i;
+		if (!e->chunk)
+			continue;
+		stringAndNum(&buf, &l, e->uid);
+		stringAndChar(&buf, &l, ' ');
+		stringAndNum(&buf, &l, e->seqno);
+		stringAndString(&buf, &l, (e->seen ? " 1 " : " 0 "));
+		stringAndNum(&buf, &l, strlen(e->chunk));
+		stringAndChar(&buf, &l, '\n');
+		stringAndString(&buf, &l, e->chunk);
+		stringAndChar(&buf, &l, '\n');
+	}
+	ignore = asprintf(&file, "%s/index", mc->dir);
+	mcWrite(file, buf, l);
+	free(file);
+	free(buf);
+}
+
+// The cached validity of a folder, for those who didn't select it.
+static int mailCacheValidity(const char *path)
+{
+	char *dir = mailCacheDir(path), *file, *buf;
+	int l, v = 0;
+	if (!dir)
+		return 0;
+	ignore = asprintf(&file, "%s/index", dir);
+	free(dir);
+	buf = mcRead(file, &l);
+	free(file);
+	if (buf && sscanf(buf, MAILCACHESTAMP " %d", &v) != 1)
+		v = 0;
+	nzFree(buf);
+	return v;
+}
+
+static char *mailBodyFile(const struct FOLDER *f, int uid)
+{
+	char *dir, *file;
+	if (!f->uidvalidity || !(dir = mailCacheDir(f->path)))
+		return 0;
+	ignore = asprintf(&file, "%s/%d", dir, uid);
+	free(dir);
+	return file;
+}
+
+static char *mailCacheBody(const struct FOLDER *f, int uid, int *lp)
+{
+	char *file = mailBodyFile(f, uid), *body;
+	if (!file)
+		return 0;
+	body = mcRead(file, lp);
+	free(file);
+	if (body)
+		debugPrint(3, "email %d from cache", uid);
+	return body;
+}
+
+static bool mailCacheHas(const struct FOLDER *f, int uid)
+{
+	char *file = mailBodyFile(f, uid);
+	bool rc = (file && !access(file, F_OK));
+	nzFree(file);
+	return rc;
+}
+
+static void mailCacheBodySave(const struct FOLDER *f, int uid,
+			      const char *body, int len)
+{
+	char *file;
+	if (len > MAILCACHEBODY || !(file = mailBodyFile(f, uid)))
+		return;
+	mcWrite(file, body, len);
+	free(file);
+	if (mcBytes >= 0)
+		mcBytes += len;
+	mcBudget();
+}
+
+/*********************************************************************
+These messages are gone from the folder, deleted, or moved elsewhere.
+Drop their bodies, and their envelopes from the index.
+The sequence numbers have shifted, so the next descent does the uid sweep.
+The caller sets active_a.
+*********************************************************************/
+
+static void mailCacheForget(const char *path, const int *uids, int n)
+{
+	struct FOLDER f0;
+	struct mailCache *mc;
+	struct mcEntry *e;
+	char *file;
+	int i;
+
+	if (!n)
+		return;
+	memset(&f0, 0, sizeof(f0));
+	f0.path = path;
+	if (!(f0.uidvalidity = mailCacheValidity(path)) ||
+	    !(mc = mailCacheLoad(&f0)))
+		return;
+	for (i = 0; i < n; ++i) {
+		if ((e = mcFind(mc, uids[i]))) {
+			e->gone = true;
+			continue;
+		}
+		ignore = asprintf(&file, "%s/%d", mc->dir, uids[i]);
+		mcUnlink(file);
+		free(file);
+	}
+	debugPrint(3, "imap cache drops %d", n);
+	mailCacheSave(mc, &f0, false);
+	mailCacheFree(mc);
+}
+
+// the uids on lines l1 through l2 of an imap folder buffer
+static int *uidsFromLines(int l1, int l2)
+{
+	int *uids = allocMem((l2 - l1 + 1) * sizeof(int));
+	int i;
+	for (i = 0; l1 <= l2; ++l1, ++i)
+		uids[i] = atoi((char *)cw->r_map[l1].text);
+	return uids;
+}
+
+static struct MIF *mifBySeqno(const struct FOLDER *f, int seqno, int *hint)
+{
+	struct MIF *mif;
+	int j;
+	if (*hint < f->nfetch && f->mlist[*hint].seqno == seqno)
+		return f->mlist + (*hint)++;
+	for (j = 0, mif = f->mlist; j < f->nfetch; ++j, ++mif)
+		if (mif->seqno == seqno) {
+			*hint = j + 1;
+			return mif;
+		}
+	return 0;
+}
+
+/*********************************************************************
+After the uid sweep: the messages in view are a run of sequence numbers,
+so their uids are a run as well, and a cached uid inside that run
+that the sweep didn't report has been expunged.
+If the run starts at 1, or ends at the last message, so much the better.
+*********************************************************************/
+
+static void mcExpunged(const struct FOLDER *f, struct mailCache *mc)
+{
+	const struct MIF *mif = f->mlist;
+	struct mcEntry *e;
+	int j, k, lo, hi, n = 0;
+	bool top;
+
+	if (!f->nfetch)
+		return;
+	for (j = 0; j < f->nfetch; ++j)
+		if (!mif[j].uid || mif[j].seqno != mif[0].seqno + j ||
+		    (j && mif[j].uid <= mif[j - 1].uid))
+			return;
+	lo = (mif[0].seqno == 1 ? 0 : mif[0].uid);
+	hi = mif[f->nfetch - 1].uid;
+	top = (f->synced && mif[f->nfetch - 1].seqno == f->nmsgs);
+
+	mcFind(mc, 0);		// sort
+	for (j = k = 0; k < mc->n; ++k) {
+		e = mc->list + k;
+		if (e->uid < lo || (e->uid > hi && !top))
+			continue;
+		while (j < f->nfetch && mif[j].uid < e->uid)
+			++j;
+		if (j < f->nfetch && mif[j].uid == e->uid)
+			continue;
+		e->gone = true;
+		++n;
+	}
+	if (n)
+		debugPrint(3, "%d expunged, dropped from imap cache", n);
+}
+
+/*********************************************************************
+Envelopes for the messages in view, from the cache, as a fetch response
+with the current sequence numbers, allocated.
+set is the range or list of sequence numbers.
+Returns null if the cache is no help, or on error, with *res_p set.
+*fast_p says nothing has changed, and we didn't talk to the server.
+*********************************************************************/
+
+static char *cachedEnvelopes(CURL * handle, struct FOLDER *f,
+			     struct mailCache *mc, const char *set,
+			     CURLcode * res_p, bool *fast_p)
+{
+	struct MIF *mif;
+	struct mcEntry *e;
+	int j, k, n, l, hint;
+	char *p, *q, *start, *t, *resp;
+	char nf[24];
+	bool fast = (f->synced && f->modseq && mc->modseq == f->modseq &&
+		     mc->exists == f->nmsgs && mc->uidnext == f->uidnext);
+
+	*fast_p = false;
+	if (!mc->n)
+		return 0;
+
+	if (fast) {
+		mcFind(mc, 0);	// sort
+// sequence numbers rise with uids, so walk both lists together
+		for (j = k = 0, mif = f->mlist; j < f->nfetch; ++j, ++mif) {
+			while (k < mc->n && mc->list[k].seqno < mif->seqno)
+				++k;
+			if (k == mc->n || mc->list[k].seqno != mif->seqno ||
+			    !mc->list[k].chunk) {
+				fast = false;
+				break;
+			}
+			mif->uid = mc->list[k].uid;
+		}
+	}
+
+	if (!fast) {
+// uids and flags for the messages in view
+		ignore = asprintf(&t, "FETCH %s (UID FLAGS)", set);
+		curl_easy_setopt(handle, CURLOPT_CUSTOMREQUEST, t);
+		free(t);
+		*res_p = getMailData(handle);
+		if (*res_p != CURLE_OK) {
+			nzFree(mailstring), mailstring = 0;
+			return 0;
+		}
+		hint = 0;
+		for (p = mailstring; (q = nextFetch(p, &n, &start)); p = q) {
+			if (!(mif = mifBySeqno(f, n, &hint)))
+				continue;
+			if (!(mif->uid = fetchUid(start)))
+				continue;
+			if ((e = mcFind(mc, mif->uid)))
+				e->seen = fetchSeen(start);
+		}
+		nzFree(mailstring), mailstring = 0;
+		mcExpunged(f, mc);
+
+// envelopes we don't have
+		t = initString(&l);
+		stringAndString(&t, &l, "UID FETCH ");
+		k = l;
+		for (j = 0, mif = f->mlist; j < f->nfetch; ++j, ++mif) {
+			if (!mif->uid)
+				continue;
+			e = mcFind(mc, mif->uid);
+			if (e && e->chunk)
+				continue;
+			if (l > k)
+				stringAndChar(&t, &l, ',');
+			stringAndNum(&t, &l, mif->uid);
+		}
+		if (l > k) {
+			stringAndString(&t, &l, " (UID FLAGS INTERNALDATE RFC822.SIZE ENVELOPE)");
+			*res_p = getEnvelopeData(handle, t);
+			free(t);
+			if (*res_p != CURLE_OK) {
+				nzFree(mailstring), mailstring = 0;
+				return 0;
+			}
+			n = 0;
+			for (p = mailstring; (q = nextFetch(p, &j, &start)); p = q) {
+				struct MIF m0;
+				m0.uid = fetchUid(start);
+				m0.seqno = 0;
+// mcNote wants to see * n FETCH (
+				mcNote(mc, &m0, start - 7);
+				++n;
+			}
+			nzFree(mailstring), mailstring = 0;
+			debugPrint(3, "%d new envelopes", n);
+		} else
+			free(t);
+	}
+
+// paste the responses together
+	resp = initString(&l);
+	for (j = 0, mif = f->mlist; j < f->nfetch; ++j, ++mif) {
+		sprintf(nf, "* %d FETCH ", mif->seqno);
+		stringAndString(&resp, &l, nf);
+		e = (mif->uid ? mcFind(mc, mif->uid) : 0);
+		if (e && e->chunk) {
+			stringAndString(&resp, &l, e->chunk);
+			e->seqno = mif->seqno;
+			e->fresh = true;
+		} else {
+			stringAndString(&resp, &l, "(UID ");
+			stringAndNum(&resp, &l, mif->uid);
+			stringAndChar(&resp, &l, ')');
+		}
+		stringAndChar(&resp, &l, '\n');
+	}
+	if (fast)
+		debugPrint(3, "envelopes from cache");
+	*fast_p = fast;
+	return resp;
+}
+
+static CURL *newMailHandle(const struct MACCOUNT *a, struct i_get *cbd,
+			   char *errbuf)
+{
+	CURL *h = curl_easy_init();
+	if (!h)
+		i_printfExit(MSG_LibcurlNoInit);
+	if(curlCiphers)
+		curl_easy_setopt(h, CURLOPT_SSL_CIPHER_LIST, curlCiphers);
+	curl_easy_setopt(h, CURLOPT_ERRORBUFFER, errbuf);
+	curl_easy_setopt(h, CURLOPT_CONNECTTIMEOUT, mailTimeout);
+	curl_easy_setopt(h, CURLOPT_WRITEFUNCTION, eb_curl_callback);
+	curl_easy_setopt(h, CURLOPT_WRITEDATA, cbd);
+	curl_easy_setopt(h, CURLOPT_VERBOSE, (debugLevel >= 4));
+	curl_easy_setopt(h, CURLOPT_DEBUGFUNCTION, ebcurl_debug_handler);
+	curl_easy_setopt(h, CURLOPT_DEBUGDATA, cbd);
+	curl_easy_setopt(h, CURLOPT_USERNAME, a->login);
+	curl_easy_setopt(h, CURLOPT_PASSWORD, a->password);
+	return h;
+}
+
+/*********************************************************************
+The body of an email comes back with the FETCH line on the front,
+and ) A018 OK stuff on the end; strip these off.
+Returns the new length.
+lastletter tracks the tag letter, to spot reconnects when debugging.
+If this lopping off code doesn't work, #if1 the code in downloadBody
+to see the original string.
+*********************************************************************/
+
+static int bodyTrim(char *s, int l, char *lastletter)
+{
+	char *t = strchr(s, '\n');
+	if (t) {
+// should always happen
+		++t;
+		l -= (t - s);
+		strmove(s, t);
+	}
+	t = s + l;
+	if (t > s && t[-1] == '\n')
+		t[-1] = 0, --l;
+	t = strrchr(s, '\n');
+	if(!t || !strstr(t, " OK ")) return l;
+// we should always be here; lop off last OK line
+// but first, check for reconnect, for debugging purposes
+	if(lastletter && t[1] != *lastletter) {
+		*lastletter = t[1];
+		debugPrint(2, "connect %c", t[1]);
+	}
+	*t = 0, l = t - s;
+	while((t = strrchr(s, '\n')) &&
+	(strstr(t, " FETCH (") ||
+	strstr(t, " EXISTS"))) {
+// lop off last FETCH line
+		*t = 0, l = t - s;
+	}
+	t = strrchr(s, '\n');
+	if(t && t[1] == ')' && t[2] == 0) // this should always happen
+		t[1] = 0, --l;
+	return l;
+}
+
+/*********************************************************************
+Read ahead.
+When reading a folder, the next few messages are fetched in the background,
+on a second connection, so the body is here when the user asks for it.
+aheadPlan() is called for each message we land on, and it lists that message
+and the ones after it, up to AHEADCOUNT messages or AHEADBYTES bytes,
+by the sizes in the envelopes.
+Bodies already fetched that are still in the plan are kept,
+the rest are thrown away.
+The thread fetches the slots in plan order, with BODY.PEEK[],
+so nothing is marked read just because we looked ahead.
+When downloadBody takes a body from the read ahead,
+it asks the thread to mark that message seen, as BODY[] would have done.
+A slot that is in flight is waited for, a slot that isn't is given up,
+and the body is fetched on the main connection as before.
+If the second connection fails, we stop reading ahead, nothing more.
+Everything in struct readAhead is guarded by ahead_mutex,
+except stop, which the progress callback peeks at.
+*********************************************************************/
+
+#define AHEADCOUNT 8
+#define AHEADBYTES 4000000
+
+struct ahead {
+	int uid, order;
+	char *body;
+	int body_l;
+	bool busy;
+};
+
+static struct readAhead {
+	bool running, broken;
+	volatile bool stop;
+	bool fetching;		// a body is coming in, and stop may cut it off
+	pthread_t tid;
+	CURL *h;
+	struct i_get cbd;
+	char cerror[CURL_ERROR_SIZE + 1];
+	char *url, *path;
+	struct ahead slots[AHEADCOUNT];
+	int *seen, seen_n, seen_a;
+	int storing;		// uid being marked seen right now
+} ra;
+
+static pthread_mutex_t ahead_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ahead_cond = PTHREAD_COND_INITIALIZER;
+
+static size_t ahead_header_callback(char *i, size_t size,
+				   size_t nitems, void *data)
+{
+	struct i_get *g = data;
+	size_t b = nitems * size;
+	stringAndBytes(&g->buffer, &g->length, i, b);
+	return b;
+}
+
+static int ahead_progress(void *p, curl_off_t dltotal, curl_off_t dlnow,
+			  curl_off_t ultotal, curl_off_t ulnow)
+{
+	return ra.fetching && ra.stop;
+}
+
+static CURLcode aheadCommand(const char *cmd, char **bufp, int *lenp)
+{
+	struct i_get hd;	// header data, where imap puts the goods
+	CURLcode res;
+	memset(&hd, 0, sizeof(hd));
+	hd.buffer = initString(&hd.length);
+	curl_easy_setopt(ra.h, CURLOPT_CUSTOMREQUEST, cmd);
+	curl_easy_setopt(ra.h, CURLOPT_HEADERFUNCTION, ahead_header_callback);
+	curl_easy_setopt(ra.h, CURLOPT_HEADERDATA, &hd);
+	nzFree(ra.cbd.buffer);
+	ra.cbd.buffer = initString(&ra.cbd.length);
+	ra.cerror[0] = 0;
+	res = curl_easy_perform(ra.h);
+	if (res == CURLE_OK && bufp)
+		*bufp = hd.buffer, *lenp = hd.length;
+	else
+		nzFree(hd.buffer);
+	return res;
+}
+
+static void aheadSeen(int uid)
+{
+	char cmd[80];
+	sprintf(cmd, "UID STORE %d +FLAGS.SILENT (\\Seen)", uid);
+	aheadCommand(cmd, 0, 0);
+}
+
+static void *aheadThread(void *ptr)
+{
+	struct ahead *a;
+	CURLcode res;
+	char *b, *cmd;
+	int i, l, uid;
+	bool reselect = false;
+
+	ignore = asprintf(&cmd, "SELECT \"%s\"", ra.path);
+	res = aheadCommand(cmd, 0, 0);
+	free(cmd);
+	pthread_mutex_lock(&ahead_mutex);
+	if (res != CURLE_OK)
+		goto fail;
+
+	while (!ra.stop) {
+		if (ra.seen_n) {
+			uid = ra.storing = ra.seen[--ra.seen_n];
+			pthread_mutex_unlock(&ahead_mutex);
+			aheadSeen(uid);
+			pthread_mutex_lock(&ahead_mutex);
+			ra.storing = 0;
+			pthread_cond_broadcast(&ahead_cond);
+			continue;
+		}
+		a = 0;
+		for (i = 0; i < AHEADCOUNT; ++i) {
+			struct ahead *c = ra.slots + i;
+			if (c->uid && !c->body && !c->busy &&
+			    (!a || c->order < a->order))
+				a = c;
+		}
+		if (!a) {
+			pthread_cond_wait(&ahead_cond, &ahead_mutex);
+			continue;
+		}
+		a->busy = true;
+		uid = a->uid;
+		pthread_mutex_unlock(&ahead_mutex);
+		ignore = asprintf(&cmd, "UID FETCH %d BODY.PEEK[]", uid);
+		debugPrint(4, "read ahead %d", uid);
+		ra.fetching = true;
+		res = aheadCommand(cmd, &b, &l);
+		ra.fetching = false;
+		free(cmd);
+		if (res == CURLE_OK) {
+			l = undosString(b, l);
+			l = bodyTrim(b, l, 0);
+		}
+		pthread_mutex_lock(&ahead_mutex);
+		a->busy = false;
+		if (res != CURLE_OK) {
+			if (ra.stop) {
+// we cut it off, and curl dropped the connection
+				reselect = true;
+				break;
+			}
+			goto fail;
+		}
+		a->body = b, a->body_l = l;
+		pthread_cond_broadcast(&ahead_cond);
+	}
+
+flush:
+/*********************************************************************
+Mark the last messages read before we go.
+If the connection was dropped, curl brings it back on the next command,
+but outside of any folder, so select it again.
+Nothing here is cut off by stop; these commands are small.
+*********************************************************************/
+	if (ra.seen_n && reselect) {
+		pthread_mutex_unlock(&ahead_mutex);
+		ignore = asprintf(&cmd, "SELECT \"%s\"", ra.path);
+		res = aheadCommand(cmd, 0, 0);
+		free(cmd);
+		pthread_mutex_lock(&ahead_mutex);
+		if (res != CURLE_OK)
+			debugPrint(3, "read ahead cannot mark %d messages read", ra.seen_n);
+	}
+	while (ra.seen_n && res == CURLE_OK) {
+		uid = ra.storing = ra.seen[--ra.seen_n];
+		pthread_mutex_unlock(&ahead_mutex);
+		aheadSeen(uid);
+		pthread_mutex_lock(&ahead_mutex);
+		ra.storing = 0;
+		pthread_cond_broadcast(&ahead_cond);
+	}
+	pthread_mutex_unlock(&ahead_mutex);
+	return NULL;
+
+fail:
+	if (!ra.stop)
+		debugPrint(3, "read ahead stops, %s", ra.cerror);
+	ra.broken = true;
+	pthread_cond_broadcast(&ahead_cond);
+	reselect = true;
+	res = CURLE_OK;
+	goto flush;
+}
+
+static void aheadStart(const struct FOLDER *f)
+{
+	memset(&ra, 0, sizeof(ra));
+	ra.url = cloneString(mailbox_url);
+	ra.path = cloneString(f->path);
+	ra.cbd.down_force = 1;
+	ra.h = newMailHandle(active_a, &ra.cbd, ra.cerror);
+	setCurlURL(ra.h, ra.url);
+	curl_easy_setopt(ra.h, CURLOPT_NOPROGRESS, 0L);
+	curl_easy_setopt(ra.h, CURLOPT_XFERINFOFUNCTION, ahead_progress);
+	if (pthread_create(&ra.tid, NULL, aheadThread, NULL)) {
+		curl_easy_cleanup(ra.h);
+		nzFree(ra.url);
+		nzFree(ra.path);
+		return;
+	}
+	ra.running = true;
+}
+
+static void aheadStop(void)
+{
+	int i;
+	if (!ra.running)
+		return;
+	pthread_mutex_lock(&ahead_mutex);
+	ra.stop = true;
+	pthread_cond_broadcast(&ahead_cond);
+	pthread_mutex_unlock(&ahead_mutex);
+	pthread_join(ra.tid, NULL);
+	for (i = 0; i < AHEADCOUNT; ++i)
+		nzFree(ra.slots[i].body);
+	nzFree(ra.seen);
+	nzFree(ra.cbd.buffer);
+	nzFree(ra.url);
+	nzFree(ra.path);
+	imapCleanupInBackground(ra.h);
+	ra.running = false;
+}
+
+/*********************************************************************
+The user is about to set or clear \Seen on this message by hand.
+Don't let a seen mark from the read ahead land after that and undo it.
+*********************************************************************/
+
+static void aheadForget(int uid)
+{
+	int i;
+	if (!ra.running)
+		return;
+	pthread_mutex_lock(&ahead_mutex);
+	for (i = 0; i < ra.seen_n; ++i)
+		if (ra.seen[i] == uid) {
+			memmove(ra.seen + i, ra.seen + i + 1,
+				(--ra.seen_n - i) * sizeof(int));
+			--i;
+		}
+	while (ra.storing == uid)
+		pthread_cond_wait(&ahead_cond, &ahead_mutex);
+	pthread_mutex_unlock(&ahead_mutex);
+}
+
+// Plan to read ahead from message j in the folder.
+static void aheadPlan(const struct FOLDER *f, int j)
+{
+	const struct MIF *mif;
+	struct ahead *a;
+	int uids[AHEADCOUNT];
+	int n = 0, bytes = 0, i, k;
+
+	if (!ra.running || ra.broken)
+		return;
+	for (mif = f->mlist + j; j < f->nfetch && n < AHEADCOUNT; ++j, ++mif) {
+		if (mif->gone || mif->uid <= 0 || mailCacheHas(f, mif->uid))
+			continue;
+		if (n && bytes + mif->size > AHEADBYTES)
+			break;
+		uids[n++] = mif->uid, bytes += mif->size;
+	}
+
+	pthread_mutex_lock(&ahead_mutex);
+	for (i = 0; i < AHEADCOUNT; ++i) {
+		a = ra.slots + i;
+		if (!a->uid)
+			continue;
+		for (k = 0; k < n; ++k)
+			if (uids[k] == a->uid)
+				break;
+		if (k < n) {
+// already have it, or it's on the way
+			a->order = k;
+			uids[k] = 0;
+			continue;
+		}
+// in flight, let it land, it will be dropped next time
+		if (a->busy)
+			continue;
+		nzFree(a->body);
+		memset(a, 0, sizeof(struct ahead));
+	}
+	for (k = i = 0; k < n; ++k) {
+		if (!uids[k])
+			continue;
+		while (i < AHEADCOUNT && ra.slots[i].uid)
+			++i;
+		if (i == AHEADCOUNT)
+			break;
+		a = ra.slots + i;
+		a->uid = uids[k], a->order = k;
+	}
+	pthread_cond_broadcast(&ahead_cond);
+	pthread_mutex_unlock(&ahead_mutex);
+}
+
+// the body of this message, if we read ahead, and it is your string now
+static char *aheadTake(int uid, int *lp)
+{
+	struct ahead *a = 0;
+	char *s = 0;
+	int i;
+
+	if (!ra.running)
+		return 0;
+	pthread_mutex_lock(&ahead_mutex);
+	for (i = 0; i < AHEADCOUNT; ++i)
+		if (ra.slots[i].uid == uid)
+			a = ra.slots + i;
+	if (!a)
+		goto done;
+	while (a->busy && !ra.broken)
+		pthread_cond_wait(&ahead_cond, &ahead_mutex);
+	if (a->busy)
+		goto done;
+	s = a->body, *lp = a->body_l;
+	memset(a, 0, sizeof(struct ahead));
+	if (!s)
+		goto done;
+	if (ra.broken) {
+// nobody to mark it seen, fetch it the old way
+		nzFree(s);
+		s = 0;
+		goto done;
+	}
+	if (ra.seen_n == ra.seen_a) {
+		ra.seen_a += 32;
+		ra.seen = (ra.seen ? reallocMem(ra.seen, ra.seen_a * sizeof(int)) :
+			   allocMem(ra.seen_a * sizeof(int)));
+	}
+	ra.seen[ra.seen_n++] = uid;
+	pthread_cond_broadcast(&ahead_cond);
+	debugPrint(3, "read ahead hit %d", uid);
+done:
+	pthread_mutex_unlock(&ahead_mutex);
+	return s;
+}
+
+/*********************************************************************
+The email came from the cache, so the server didn't mark it seen,
+as it does when we fetch the body. Do that here.
+If it doesn't work, the email is still unread on the server, nothing more.
+*********************************************************************/
+
+static void markSeen(CURL *h, struct FOLDER *f, int uid)
+{
+	char cust_cmd[80];
 	CURLcode res;
 	bool retry = false;
-
-	curl_easy_setopt(h, CURLOPT_VERBOSE, (debugLevel >= 4));
-
+	sprintf(cust_cmd, "UID STORE %d +FLAGS.SILENT (\\Seen)", uid);
 again:
-	curl_easy_setopt(h, CURLOPT_CUSTOMREQUEST, cmd);
+	curl_easy_setopt(h, CURLOPT_CUSTOMREQUEST, cust_cmd);
 	res = getMailData(h);
 	nzFree(mailstring), mailstring = 0;
-	if (res != CURLE_OK) {
-		if(retry || !refolder(h, &f0, res))
-			goto abort;
+	if (res != CURLE_OK && !retry && refolder(h, f, res)) {
 		retry = true;
 		goto again;
 	}
-return true;
-
-abort:
-	ebcurl_setError(res, cf->firstURL, 0, cerror);
-	return false;
 }
 
 // download the email from the imap server
 static bool partread;
 static CURLcode downloadBody(CURL *h, struct FOLDER *f, int uid)
 {
-	char *t;
 	bool retry;
 	CURLcode res;
 	char cust_cmd[80];
+	char *body;
+	int l;
 
 	retry = partread = false;
+	if ((body = mailCacheBody(f, uid, &l))) {
+		markSeen(h, f, uid);
+		mailstring = body, mailstring_l = l;
+		return CURLE_OK;
+	}
+	if ((mailstring = aheadTake(uid, &mailstring_l))) {
+		mailCacheBodySave(f, uid, mailstring, mailstring_l);
+		return CURLE_OK;
+	}
 redown:
 	sprintf(cust_cmd, "UID FETCH %d BODY[]", uid);
 	curl_easy_setopt(h, CURLOPT_CUSTOMREQUEST, cust_cmd);
@@ -1009,42 +2441,11 @@ You'll see this after the perform function runs.
 	}
 afterfetch:
 #if 0
-	t = 0; FILE *z; z = fopen("msb", "we"); fprintf(z, "%s", mailstring); fclose(z);
+	FILE *z; z = fopen("msb", "we"); fprintf(z, "%s", mailstring); fclose(z);
 #endif
-
-// have to strip fetch BODY line off the front,
-// and take ) A018 OK stuff off the end.
-// If this lopping off code doesn't work, #if1 the above to see the original mailstring
-	t = strchr(mailstring, '\n');
-	if (t) {
-// should always happen
-		++t;
-		mailstring_l -= (t - mailstring);
-		strmove(mailstring, t);
-	}
-	t = mailstring + mailstring_l;
-	if (t > mailstring && t[-1] == '\n')
-		t[-1] = 0, --mailstring_l;
-	t = strrchr(mailstring, '\n');
-	if(!t || !strstr(t, " OK ")) goto done;
-// we should always be here; lop off last OK line
-// but first, check for reconnect, for debugging purposes
-	if(t[1] != active_a->lastletter) {
-		active_a->lastletter = t[1];
-		debugPrint(2, "connect %c", t[1]);
-	}
-	*t = 0, mailstring_l = t - mailstring;
-	while((t = strrchr(mailstring, '\n')) &&
-	(strstr(t, " FETCH (") ||
-	strstr(t, " EXISTS"))) {
-// lop off last FETCH line
-		*t = 0, mailstring_l = t - mailstring;
-	}
-	t = strrchr(mailstring, '\n');
-	if(t && t[1] == ')' && t[2] == 0) // this should always happen
-		t[1] = 0, --mailstring_l;
-
-done:
+	mailstring_l = bodyTrim(mailstring, mailstring_l, &active_a->lastletter);
+	if (!partread)
+		mailCacheBodySave(f, uid, mailstring, mailstring_l);
 	return CURLE_OK;
 }
 
@@ -1079,10 +2480,12 @@ static void scanFolder(CURL * handle, struct FOLDER *f)
 	nzFree(mailstring);
 	if (res != CURLE_OK) {
 abort:
+		aheadStop();
 		ebcurl_setError(res, mailbox_url, 1, cerror);
 		i_puts(MSG_EndFolder);
 		return;
 	}
+	aheadStart(f);
 
 showmessages:
 
@@ -1091,6 +2494,7 @@ showmessages:
 		if (mif->gone)
 			continue;
 reaction:
+		aheadPlan(f, j);
 		printEnvelope(mif, 0);
 action:
 		delflag = retry = partread = false;
@@ -1116,7 +2520,9 @@ imap_done:
  * and under some anomalous situations, it can take over a minute.
  * We don't lose anything by simply dropping the socket.
 			curl_easy_cleanup(handle);
+ * We do wait for the read ahead, which may owe the server some seen marks.
  */
+			aheadStop();
 			exit(0);
 		}
 
@@ -1127,7 +2533,7 @@ imap_done:
 				goto imap_done;
 			if(!isInteractive) printf("%s", inputline);
 research:
-			j2 = imapSearch(handle, f, inputline, false, &res);
+			j2 = imapSearch(handle, f, inputline, false, &res, 0);
 			if(j2 == 0) goto reaction;
 			if(j2 < 0) {
 				if(retry || !refolder(handle, f, res))
@@ -1326,8 +2732,10 @@ re_move:
 					retry = true;
 					goto re_move;
 				}
-				if (active_a->move_capable) mif->gone = true;
-				else delflag = true;
+				if (active_a->move_capable) {
+					mif->gone = true;
+					mailCacheForget(f->path, &mif->uid, 1);
+				} else delflag = true;
 			} else{
 				if(g) i_puts(MSG_SameFolder);
 				goto reaction;
@@ -1336,6 +2744,7 @@ re_move:
 
 	if(key == 'r' || key == 'R') {
 		i_puts(MSG_MailRead + (key == 'R'));
+		aheadForget(mif->uid);
 reunread:
 		sprintf(cust_cmd, "UID STORE %d %cFlags \\Seen", mif->uid, (key == 'r' ? '+' : '-'));
 		curl_easy_setopt(handle, CURLOPT_CUSTOMREQUEST, cust_cmd);
@@ -1379,10 +2788,12 @@ redelete:
 			goto redelete;
 		}
 		mif->gone = true;
+		mailCacheForget(f->path, &mif->uid, 1);
 		debugPrint(3, "` %d EXPUNGE", mif->uid);
 		if(!expunge(handle)) goto abort;
 	}
 
+	aheadStop();
 	i_puts(MSG_EndFolder);
 }
 
@@ -1457,22 +2868,35 @@ char **name, char **addr)
 	return true;
 }
 
-static bool envelopes(CURL * handle, struct FOLDER *f)
+/*********************************************************************
+Fetch and parse the envelopes for the messages in f->mlist.
+mc0 is the imap cache, if the caller holds it across several calls,
+as a search does, page by page; otherwise we load it and save it here.
+On failure, *res_p, if given, has the curl code.
+*********************************************************************/
+
+static bool envelopes(CURL * handle, struct FOLDER *f,
+		      struct mailCache *mc0, CURLcode *res_p)
 {
 	int j;
 	char *t, *u;
 	CURLcode res;
 	int sublength;
-	char cust_cmd[80];
+	char *seqlist; // list of sequence numbers, if not a range
+	int seqlist_l;
+	char range[24];
+	const char *set;
 	char nf[24]; // next fetch
 	char *sfp; // start fetch pointer
 	char *nfp; // next fetch pointer
 	struct MIF *mif;
+	struct mailCache *mc;
+	bool fromcache = false, fast = false;
 
 // when this comes from a search, not a normal descend,
 // the emails are not in order, and we can't use a range.
 // Check for this and build a list instead.
-	imapLines = initString(&iml_l);
+	seqlist = initString(&seqlist_l);
 	mif = f->mlist;
 	if(mif->seqno == f->start) {
 		for (j = 1, ++mif; j < f->nfetch; ++j, ++mif)
@@ -1483,29 +2907,13 @@ static bool envelopes(CURL * handle, struct FOLDER *f)
 // Ouch! Make the list.
 	mif = f->mlist;
 	for (j = 0; j < f->nfetch; ++j, ++mif) {
-		if(j) stringAndChar(&imapLines, &iml_l, ',');
-	stringAndNum(&imapLines, &iml_l, mif->seqno);
+		if(j) stringAndChar(&seqlist, &seqlist_l, ',');
+	stringAndNum(&seqlist, &seqlist_l, mif->seqno);
 	}
 
 range:
-// capture the uids
-	if(*imapLines) {
-		ignore = asprintf(&t, "FETCH %s UID", imapLines);
-	} else {
-		sprintf(cust_cmd, "FETCH %d:%d UID", f->start, f->start + f->nfetch - 1);
-		t = cust_cmd;
-	}
-	curl_easy_setopt(handle, CURLOPT_CUSTOMREQUEST, t);
-	if(*imapLines) free(t);
-	res = getMailData(handle);
-	if (res != CURLE_OK) goto abort;
-#if 0
-	FILE *z; z = fopen("ms1", "we"); fprintf(z, "%s", mailstring); fclose(z);
-#endif
-
-	t = mailstring;
-	for (j = 0; j < f->nfetch; ++j) {
-		mif = f->mlist + j;
+	mif = f->mlist;
+	for (j = 0; j < f->nfetch; ++j, ++mif) {
 // defaults
 		mif->startlist = f->mlist;
 		mif->subject = emptyString;
@@ -1514,55 +2922,33 @@ range:
 		mif->reply = emptyString;
 		mif->prec = emptyString;
 		mif->ccrec = emptyString;
-
-		if(!t || !(t = strstr(t, "FETCH (UID "))) {
-			printf("mail %d has no uid, operations will not work!", mif->seqno);
-			continue;
-		}
-		t += 11;
-		while (*t == ' ') ++t;
-		if (isdigitByte(*t))
-			mif->uid = atoi(t);
-		else
-			printf("mail %d has no uid, operations will not work!", mif->seqno);
 	}
-		nzFree(mailstring), mailstring = 0;
 
-// get envelopes
-	if(*imapLines) {
-		ignore = asprintf(&t, "FETCH %s ALL", imapLines);
-	} else {
-		sprintf(cust_cmd, "FETCH %d:%d ALL", f->start, f->start + f->nfetch - 1);
-		t = cust_cmd;
-	}
-	curl_easy_setopt(handle, CURLOPT_CUSTOMREQUEST, t);
-	if(*imapLines) free(t);
+	sprintf(range, "%d:%d", f->start, f->start + f->nfetch - 1);
+	set = (*seqlist ? seqlist : range);
 
-/*********************************************************************
-Originally I used the WRITEFUNCTION to get the envelope data.
-That returns the untagged line, and that was right 99% of the time.
-That held the entire envelope.
-But once in a while the envelope continued on the next line,
-the body line, the other line, whatever you call it.
-For that eventuality I have to use the HEADERFUNCTION as well.
-Both do the same thing, the same function, gather data.
-But now I get the untagged line twice.
-I need to use the header function without the write function.
-If I leave the write function null, curl core dumps.
-I have to use a stub function. You'll see below.
-*********************************************************************/
+// try the cache first
+	res = CURLE_OK;
+	if ((mc = (mc0 ? mc0 : mailCacheLoad(f))) &&
+	    (mailstring = cachedEnvelopes(handle, f, mc, set, &res, &fast))) {
+		fromcache = true;
+		goto parse;
+	}
+	if (res != CURLE_OK)
+		goto abort;
 
-	curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, eb_curl_callback);
-	curl_easy_setopt(handle, CURLOPT_HEADERDATA, &callback_data);
-	curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, imap_null_callback);
-	res = getMailData(handle);
-// and put things back
-	curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, eb_curl_callback);
-	curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, NULL);
-	curl_easy_setopt(handle, CURLOPT_HEADERDATA, NULL);
+// get uids and envelopes, in one round trip; ALL is the last four items
+	ignore = asprintf(&t, "FETCH %s (UID FLAGS INTERNALDATE RFC822.SIZE ENVELOPE)", set);
+	res = getEnvelopeData(handle, t);
+	free(t);
 	if (res != CURLE_OK) {
 abort:
-		nzFree(imapLines);
+		nzFree(seqlist);
+		if (!mc0)
+			mailCacheFree(mc);
+		if (res_p)
+			*res_p = res;
+		f->synced = false;
 		ebcurl_setError(res, mailbox_url, (ismc ? 2 : 0), cerror);
 		nzFree(mailstring), mailstring = 0;
 		return false;
@@ -1571,6 +2957,7 @@ abort:
 	FILE *z; z = fopen("ms2", "we"); fprintf(z, "%s", mailstring); fclose(z);
 #endif
 
+parse:
 // Don't free mailstring, we're using pieces of it
 	f->cbase = mailstring;
 	sfp = mailstring;
@@ -1583,6 +2970,11 @@ abort:
 		nfp = strstr(sfp, nf); // find next fetch
 		if(nfp) nfp[-1] = 0;
 
+// uid first, before the envelope parsing below chops things up
+		mif->uid = fetchUid(sfp);
+		if (mc && !fromcache)
+			mcNote(mc, mif, sfp);
+
 /*********************************************************************
 Before we start cracking, here are a couple of illustrative examples.
 You can get these, or another envelope that doesn't seem to parse
@@ -1749,7 +3141,31 @@ next_m:
 	sfp = nfp;
 	}
 
-	nzFree(imapLines); // in case it was a list
+	mif = f->mlist;
+	for (j = 0; j < f->nfetch; ++j, ++mif)
+		if(!mif->uid)
+			printf("mail %d has no uid, operations will not work!", mif->seqno);
+
+	if (mc) {
+// flags in the cached responses may be old, the sweep has the current ones
+		if (fromcache) {
+			f->unread = 0;
+			for (j = 0, mif = f->mlist; j < f->nfetch; ++j, ++mif) {
+				struct mcEntry *e = mcFind(mc, mif->uid);
+				if (e)
+					mif->seen = e->seen;
+				if (!mif->seen)
+					++f->unread;
+			}
+		}
+		if (!mc0) {
+			mailCacheSave(mc, f, fast);
+			mailCacheFree(mc);
+		}
+	}
+	f->synced = false;
+
+	nzFree(seqlist); // in case it was a list
 	return true;
 }
 
@@ -1765,9 +3181,10 @@ static bool examineFolder(CURL * handle, struct FOLDER *f, bool dostats)
 	if(fl < 0) earliest = true, fl = -fl;
 	cleanFolder(f);
 
-/* interrogate folder */
+/* interrogate folder, and ask what has changed, if the server can tell us */
 again:
-	ignore = asprintf(&t, "SELECT \"%s\"", f->path);
+	ignore = asprintf(&t, "SELECT \"%s\"%s", f->path,
+			  (!dostats && active_a->condstore ? " (CONDSTORE)" : ""));
 	curl_easy_setopt(handle, CURLOPT_CUSTOMREQUEST, t);
 	free(t);
 	res = getMailData(handle);
@@ -1804,6 +3221,14 @@ again:
 			f->uidnext = atoi(t);
 	}
 
+	t = strstr(mailstring, "UIDVALIDITY ");
+	if (t)
+		f->uidvalidity = atoi(t + 12);
+	t = strstr(mailstring, "HIGHESTMODSEQ ");
+	if (t)
+		f->modseq = strtoull(t + 14, 0, 10);
+	f->synced = !dostats;
+
 	nzFree(mailstring);
 	if (dostats) {
 		if(!ismc) { // running within a buffer
@@ -1838,7 +3263,7 @@ again:
 		mif->seqno = f->start + j;
 	}
 
-	if(!envelopes(handle, f)) return false;
+	if(!envelopes(handle, f, 0, 0)) return false;
 
 	if (debugLevel > 0 && ismc) {
 		if (f->nmsgs > f->nfetch)
@@ -1850,36 +3275,53 @@ again:
 	return true;
 }
 
-/* find the last mail in the local unread directory */
-static int unreadMax, unreadMin, unreadCount;
-static int unreadBase;		/* find min larger than base */
+/*********************************************************************
+The local unread directory, as a sorted list of message numbers.
+The reader steps through this list, rather than scanning the directory
+for the next message, which was quadratic in the size of the spool.
+unreadMax is the last one, new mail goes after it.
+If a message on the list disappears, another edbrowse is reading
+the same spool, so the list is stale, and we build it again.
+*********************************************************************/
+
+static int unreadMax;
+static int *unreadList, unreadCount;
+
+static int unread_cmp(const void *s, const void *t)
+{
+	int n1 = *(const int *)s, n2 = *(const int *)t;
+	return (n1 < n2 ? -1 : n1 > n2);
+}
 
 static void unreadStats(void)
 {
 	const char *f;
-	int n;
+	int a = 0;
 
 	unreadMax = 0;
-	unreadMin = 0;
 	unreadCount = 0;
+	nzFree(unreadList);
+	unreadList = 0;
 
 	while ((f = nextScanFile(mailUnread))) {
 		if (!stringIsNum(f))
 			continue;
-		n = atoi(f);
-		if (n > unreadMax)
-			unreadMax = n;
-		if (n > unreadBase) {
-			if (!unreadMin || n < unreadMin)
-				unreadMin = n;
-			++unreadCount;
+		if (unreadCount == a) {
+			a = (a ? a * 2 : 256);
+			unreadList = (unreadList ?
+				      reallocMem(unreadList, a * sizeof(int)) :
+				      allocMem(a * sizeof(int)));
 		}
+		unreadList[unreadCount++] = atoi(f);
 	}
+	if (!unreadCount)
+		return;
+	qsort(unreadList, unreadCount, sizeof(int), unread_cmp);
+	unreadMax = unreadList[unreadCount - 1];
 }
 
 static char *umf;		/* unread mail file */
 static char *umf_end;
-static int umfd;		/* file descriptor for the above */
 /* convert mail message to/from utf8 if need be. */
 /* This isn't really right, cause it should be done per mime component. */
 static char *mailu8;
@@ -1925,48 +3367,139 @@ static void get_mailbox_url(const struct MACCOUNT *a)
 	mailbox_url = url;
 }
 
-/* reads message into mailstring, it's up to you to free it */
-static CURLcode fetchOneMessage(CURL * handle, int message_number)
+/*********************************************************************
+pop3 fetch, one account at a time, or several at once.
+When fetching from all accounts, each account gets its own thread,
+with its own curl handle, so the time is the slowest account,
+rather than the sum of them all.
+Everything a fetch needs is in struct popFetch, not in the globals
+that the imap client and the mail reader use.
+The messages are written to mailbox/unread, and they all draw
+from one counter, under unread_mutex, and open with O_EXCL,
+so no two messages land in the same file.
+RETR and DELE for a message go back to back on the same connection;
+curl does not pipeline pop3 commands, so that is as close as we get,
+and the server doesn't delete anything until QUIT, which happens
+when the handle is cleaned up, after all the messages are safely on disk.
+*********************************************************************/
+
+struct popFetch {
+	const struct MACCOUNT *a;
+	int account;
+	CURL *h;
+	struct i_get cbd;	// callback data
+	char cerror[CURL_ERROR_SIZE + 1];
+	char *url;
+	int nfetch;
+	pthread_t tid;
+	bool threaded;
+};
+
+static pthread_mutex_t unread_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// save a message in the next unread file
+static void saveUnread(const char *data, int len)
 {
-	CURLcode res = CURLE_OK;
+	char *file = allocMem(strlen(mailUnread) + 12);
+	int fd;
+	pthread_mutex_lock(&unread_mutex);
+	while (true) {
+		sprintf(file, "%s/%d", mailUnread, ++unreadMax);
+		fd = open(file, O_WRONLY | O_TEXT | O_CREAT | O_EXCL | O_CLOEXEC,
+			  MODE_rw);
+		if (fd >= 0 || errno != EEXIST)
+			break;
+	}
+	pthread_mutex_unlock(&unread_mutex);
+	if (fd < 0)
+		i_printfExit(MSG_NoCreate, file);
+	if (write(fd, data, len) < len)
+		i_printfExit(MSG_NoWrite, file);
+	close(fd);
+	free(file);
+}
 
-	res = setCurlURL(handle, message_url);
-	if (res != CURLE_OK)
-		return res;
-	res = curl_easy_setopt(handle, CURLOPT_CUSTOMREQUEST, NULL);
-	if (res != CURLE_OK)
-		return res;
-	res = curl_easy_setopt(handle, CURLOPT_NOBODY, 0L);
+static CURLcode popData(struct popFetch *pf)
+{
+	struct i_get *g = &pf->cbd;
+	CURLcode res;
+	pf->cerror[0] = 0;
+	nzFree(g->buffer);
+	g->buffer = initString(&g->length);
+	res = curl_easy_perform(pf->h);
+	return res;
+}
+
+// Retrieve message n, save it in unread, and delete it from the server.
+static CURLcode popOneMessage(struct popFetch *pf, int n)
+{
+	struct i_get *g = &pf->cbd;
+	CURLcode res;
+	char *murl;
+
+	ignore = asprintf(&murl, "%s%u", pf->url, n);
+	res = setCurlURL(pf->h, murl);
+	free(murl);
 	if (res != CURLE_OK)
 		return res;
-
-	res = getMailData(handle);
-	undosOneMessage();
+	curl_easy_setopt(pf->h, CURLOPT_CUSTOMREQUEST, NULL);
+	curl_easy_setopt(pf->h, CURLOPT_NOBODY, 0L);
+	res = popData(pf);
 	if (res != CURLE_OK)
 		return res;
 
-/* got the file, save it in unread */
-	sprintf(umf_end, "%d", unreadMax + message_number);
-	umfd = open(umf, O_WRONLY | O_TEXT | O_CREAT | O_CLOEXEC, MODE_rw);
-	if (umfd < 0)
-		i_printfExit(MSG_NoCreate, umf);
-	if (write(umfd, mailstring, mailstring_l) < mailstring_l)
-		i_printfExit(MSG_NoWrite, umf);
-	close(umfd);
+	g->length = undosString(g->buffer, g->length);
+	saveUnread(g->buffer, g->length);
+	++pf->nfetch;
 
-	return res;
+	curl_easy_setopt(pf->h, CURLOPT_CUSTOMREQUEST, "DELE");
+	curl_easy_setopt(pf->h, CURLOPT_NOBODY, 1L);
+	return popData(pf);
 }
 
-static CURLcode deleteOneMessage(CURL * handle)
+static void *popFetch(void *ptr)
 {
-	CURLcode res = curl_easy_setopt(handle, CURLOPT_CUSTOMREQUEST, "DELE");
+	struct popFetch *pf = ptr;
+	const struct MACCOUNT *a = pf->a;
+	struct i_get *g = &pf->cbd;
+	CURLcode res;
+	int i, n = 0;
+	bool last_nl = true;
+
+	ignore = asprintf(&pf->url, "%s://%s:%d/",
+		(a->inssl ? "pop3s" : "pop3"), a->inurl, a->inport);
+	debugPrint(3, "fetch from %d %s", pf->account, a->inurl);
+	pf->h = newMailHandle(a, g, pf->cerror);
+
+// the list of messages, one per line
+	res = setCurlURL(pf->h, pf->url);
+	if (res == CURLE_OK)
+		res = popData(pf);
 	if (res != CURLE_OK)
-		return res;
-	res = curl_easy_setopt(handle, CURLOPT_NOBODY, 1L);
+		goto done;
+	for (i = 0; i < g->length; i++) {
+		if (g->buffer[i] == '\n' || g->buffer[i] == '\r') {
+			last_nl = true;
+			continue;
+		}
+		if (last_nl && isdigitByte(g->buffer[i]))
+			n++;
+		last_nl = false;
+	}
+
+	for (i = 1; i <= n; ++i) {
+		res = popOneMessage(pf, i);
+		if (res != CURLE_OK)
+			break;
+	}
+
+done:
 	if (res != CURLE_OK)
-		return res;
-	res = getMailData(handle);
-	return res;
+		ebcurl_setError(res, pf->url, 1, pf->cerror);
+	curl_easy_cleanup(pf->h);
+	nzFree(g->buffer);
+	nzFree(pf->url);
+	return NULL;
 }
 
 static CURLcode count_messages(CURL * handle, int *message_count)
@@ -2161,76 +3694,63 @@ refresh:
 	return CURLE_OK;
 }
 
-// Returns number of messages fetched, but if this is imap,
-// it doesn't return at all.
-int fetchMail(int account)
+static void unreadSetup(void)
 {
-	CURL *mail_handle;
-	struct MACCOUNT *a = accounts + account - 1;
-	const char *login = a->login;
-	const char *pass = a->password;
-	int nfetch = 0;		/* number of messages actually fetched */
-	CURLcode res = CURLE_OK;
-	const char *url_for_error;
-	int message_count = 0, message_number;
-
-	active_a = a, isimap = a->imap;
-	get_mailbox_url(a);
-	url_for_error = mailbox_url;
-
 	if (!mailDir)
 		i_printfExit(MSG_NoMailDir);
 	if (chdir(mailDir))
 		i_printfExit(MSG_NoDirChange, mailDir);
-
 	if (!umf) {
 		umf = allocMem(strlen(mailUnread) + 12);
 		sprintf(umf, "%s/", mailUnread);
 		umf_end = umf + strlen(umf);
 	}
-	unreadBase = 0;
 	unreadStats();
+}
 
-	mail_handle = newFetchmailHandle(login, pass);
-	res = count_messages(mail_handle, &message_count);
-	if (res != CURLE_OK)
-		goto fetchmail_cleanup;
-// count_messages does not return on imap
+// Returns number of messages fetched, but if this is imap,
+// it doesn't return at all.
+int fetchMail(int account)
+{
+	CURL *mail_handle;
+	struct MACCOUNT *a = accounts + account - 1;
+	CURLcode res;
+	int message_count = 0;
 
-	for (message_number = 1; message_number <= message_count;
-	     message_number++) {
-		ignore = asprintf(&message_url, "%s%u", mailbox_url, message_number);
-		res = fetchOneMessage(mail_handle, message_number);
-		if (res != CURLE_OK)
-			goto fetchmail_cleanup;
-		nfetch++;
-		res = deleteOneMessage(mail_handle);
-		if (res != CURLE_OK)
-			goto fetchmail_cleanup;
-		nzFree(message_url);
-		message_url = 0;
+	unreadSetup();
+
+	if (!a->imap) {
+		struct popFetch pf;
+		memset(&pf, 0, sizeof(pf));
+		pf.a = a, pf.account = account;
+		popFetch(&pf);
+		return pf.nfetch;
 	}
 
-fetchmail_cleanup:
-	if (message_url)
-		url_for_error = message_url;
-	if (res != CURLE_OK)
-		ebcurl_setError(res, url_for_error, 1, cerror);
+	active_a = a, isimap = true;
+	get_mailbox_url(a);
+	mail_handle = newFetchmailHandle(a->login, a->password);
+	res = count_messages(mail_handle, &message_count);
+// count_messages does not return on imap, unless something goes wrong
+	ebcurl_setError(res, mailbox_url, 1, cerror);
 	curl_easy_cleanup(mail_handle);
-	nzFree(message_url);
 	nzFree(mailbox_url);
-	message_url = mailbox_url = 0;
+	mailbox_url = 0;
 	nzFree(mailstring);
 	mailstring = initString(&mailstring_l);
-	return nfetch;
+	return 0;
 }
 
 /* fetch from all accounts except those with nofetch or imap set */
 int fetchAllMail(void)
 {
-	int i, j;
+	int i, j, n = 0;
 	const struct MACCOUNT *a, *b;
 	int nfetch = 0;
+	struct popFetch *list, *pf;
+
+	unreadSetup();
+	list = allocZeroMem(maxAccount * sizeof(struct popFetch) + 1);
 
 	for (i = 1; i <= maxAccount; ++i) {
 		a = accounts + i - 1;
@@ -2248,10 +3768,29 @@ int fetchAllMail(void)
 		if (j < i)
 			continue;
 
-		debugPrint(3, "fetch from %d %s", i, a->inurl);
-		nfetch += fetchMail(i);
+		pf = list + n++;
+		pf->a = a, pf->account = i;
+	}
+
+// one account runs right here, more than one run in parallel
+	for (i = 0; i < n; ++i) {
+		pf = list + i;
+// dots from parallel fetches would only be jumbled
+		if (n > 1)
+			pf->cbd.down_force = 1;
+		if (n > 1 && !pthread_create(&pf->tid, NULL, popFetch, pf))
+			pf->threaded = true;
+		else
+			popFetch(pf);
+	}
+	for (i = 0; i < n; ++i) {
+		pf = list + i;
+		if (pf->threaded)
+			pthread_join(pf->tid, NULL);
+		nfetch += pf->nfetch;
 	}
 
+	free(list);
 	return nfetch;
 }
 
@@ -2262,26 +3801,15 @@ static void writeReplyInfo(const char *addstring);
 // or -fm7 where account 7 is pop3. This is not imap.
 void scanUnreadMail(void)
 {
-	int nmsgs, m;
+	int nmsgs, m, n;
 	char key;
 	bool plain = false;
 
 	if (!isInteractive)
 		i_printfExit(MSG_FetchNotBackgnd);
-	if (!mailDir)
-		i_printfExit(MSG_NoMailDir);
-	if (chdir(mailDir))
-		i_printfExit(MSG_NoDirChange, mailDir);
-
-	if (!umf) {
-		umf = allocMem(strlen(mailUnread) + 12);
-		sprintf(umf, "%s/", mailUnread);
-		umf_end = umf + strlen(umf);
-	}
 
 /* How many mail messages? */
-	unreadBase = 0;
-	unreadStats();
+	unreadSetup();
 	nmsgs = unreadCount;
 	if (!nmsgs) {
 		i_puts(MSG_NoMail);
@@ -2289,17 +3817,26 @@ void scanUnreadMail(void)
 	}
 	i_printf(MSG_MessagesX, nmsgs);
 
-	for (m = 1; m <= nmsgs; ++m) {
+	for (m = 0; m < unreadCount; ++m) {
 // Now grab the entire message
-		unreadStats();
-		sprintf(umf_end, "%d", unreadMin);
-		if (!fileIntoMemory(umf, &mailstring, &mailstring_l, 0))
-			showErrorAbort();
-		unreadBase = unreadMin;
+		n = unreadList[m];
+		sprintf(umf_end, "%d", n);
+		if (!fileIntoMemory(umf, &mailstring, &mailstring_l, 0)) {
+			if (access(umf, F_OK) == 0)
+				showErrorAbort();
+// somebody else took it, pick up with the next message after n
+			debugPrint(3, "unread %d is gone, rescan", n);
+			unreadStats();
+			for (m = 0; m < unreadCount; ++m)
+				if (unreadList[m] > n)
+					break;
+			--m;
+			continue;
+		}
 
 		key = presentMail(&plain);
-		if(key == 'g') { --m, --unreadBase; continue; }
-		if(key == 't') { plain ^= 1; --m, --unreadBase; continue; }
+		if(key == 'g') { --m; continue; }
+		if(key == 't') { plain ^= 1; --m; continue; }
 		if (key == 'd')
 			unlink(umf);
 		plain = false;
@@ -4258,15 +5795,14 @@ teardown:
 	return true;
 }
 
-static void makeLinesAndUids(const struct FOLDER *f)
+// add lines for messages from through from+n-1 to imapLines and imapPaths
+static void makeLinesAndUids(const struct FOLDER *f, int from, int n)
 {
 	int j;
 	const struct MIF *mif;
 	char *p;
-	mif = f->mlist;
-	imapLines = initString(&iml_l);
-	imapPaths = initString(&imp_l);
-	for (j = 0; j < f->nfetch; ++j, ++mif) {
+	mif = f->mlist + from;
+	for (j = 0; j < n; ++j, ++mif) {
 		char uidbuf[12];
 		printEnvelope(mif, &p);
 		stringAndString(&imapLines, &iml_l, p);
@@ -4299,7 +5835,9 @@ bool folderDescend(const char *path, bool rf)
 		cleanFolder(&f0);
 		return false;
 	}
-	makeLinesAndUids(&f0);
+	imapLines = initString(&iml_l);
+	imapPaths = initString(&imp_l);
+	makeLinesAndUids(&f0, 0, f0.nfetch);
 	if(!rf) {
 		freeWindows(context, false); // lop off stuff below
 // make new window
@@ -4329,6 +5867,41 @@ bool folderDescend(const char *path, bool rf)
 	return true;
 }
 
+/*********************************************************************
+Called by imapSearch as each page of envelopes comes in.
+Make the window on the first page, unless this is a refresh,
+then add the lines to the end of the buffer.
+The uids and subjects pile up in imapPaths,
+and go to the backend when all the pages are in.
+*********************************************************************/
+
+static const char *sp_path, *sp_search;
+static bool sp_rf;
+
+static void searchPage(const struct FOLDER *f, int from, int n)
+{
+	Window *w;
+	int l = iml_l;
+	if(!from && !sp_rf) {
+		freeWindows(context, false); // lop off stuff below
+// make new window
+		w = createWindow();
+		w->imap_h = cw->imap_h;
+		w->imap_n = cw->imap_n;
+		w->imap_l = cw->imap_l;
+		strcpy(w->imap_env, cw->imap_env);
+		w->baseDirName = cloneString(sp_path);
+		w->r_dot = cw->dot;
+// I'm overloading this field abit, it's obviously not an email
+		w->mail_raw = cloneString(sp_search);
+		w->prev = cw, cw = w, sessionList[context].lw = cw, cf = &cw->f0;
+		cw->imapMode2 = true;
+		ignore = asprintf(&cf->fileName, "envelopes %s /%s", sp_path, sp_search);
+	}
+	makeLinesAndUids(f, from, n);
+	addTextToBuffer((uchar *)imapLines + l, iml_l - l, cw->dol, false);
+}
+
 // rf parameter means refresh
 bool folderSearch(const char *path, char *search, bool rf)
 {
@@ -4336,10 +5909,10 @@ bool folderSearch(const char *path, char *search, bool rf)
 	CURL *h = cw->imap_h;
 	int act = cw->imap_n;
 	struct MACCOUNT *a = accounts + act - 1;
-	Window *w;
 	const char *t = search;
 	char *u;
 	bool unseen = false, retry = false;
+	int validity = 0;
 
 	if(*t == 'u') ++t, unseen = true;
 	if(*t) ++t;
@@ -4371,6 +5944,8 @@ again:
 	curl_easy_setopt(h, CURLOPT_CUSTOMREQUEST, u);
 	free(u);
 	res = getMailData(h);
+	if(res == CURLE_OK && (u = strstr(mailstring, "UIDVALIDITY ")))
+		validity = atoi(u + 12);
 	nzFree(mailstring), mailstring = 0;
 	if(res != CURLE_OK) {
 		if(!retry) { retry = true; goto again; }
@@ -4381,31 +5956,20 @@ again:
 	struct FOLDER f0;
 	memset(&f0, 0, sizeof(f0));
 	f0.path = path;
-	if(imapSearch(h, &f0, search + unseen, unseen, &res) <= 0) {
+	f0.uidvalidity = validity; // for the cache
+	sp_path = path, sp_search = search, sp_rf = rf;
+	imapLines = initString(&iml_l);
+	imapPaths = initString(&imp_l);
+	if(imapSearch(h, &f0, search + unseen, unseen, &res, searchPage) <= 0) {
 		cleanFolder(&f0);
+		nzFree(imapLines), imapLines = 0;
+		nzFree(imapPaths), imapPaths = 0;
 		if(res != CURLE_OK)
 			ebcurl_setError(res, cf->firstURL, 0, cerror);
 		return false;
 	}
 
-	if(!rf) {
-		freeWindows(context, false); // lop off stuff below
-// make new window
-		w = createWindow();
-		w->imap_h = h;
-		w->imap_n = act;
-		w->imap_l = cw->imap_l;
-		strcpy(w->imap_env, cw->imap_env);
-		w->baseDirName = cloneString(path);
-		w->r_dot = cw->dot;
-// I'm overloading this field abit, it's obviously not an email
-		w->mail_raw = cloneString(search);
-		w->prev = cw, cw = w, sessionList[context].lw = cw, cf = &cw->f0;
-		cw->imapMode2 = true;
-		ignore = asprintf(&cf->fileName, "envelopes %s /%s", path, search);
-	}
-	makeLinesAndUids(&f0);
-	addTextToBuffer((uchar *)imapLines, iml_l, 0, false);
+// the lines are in the buffer, page by page, now the uids behind them
 	addTextToBackend(imapPaths);
 	nzFree(imapLines), imapLines = 0;
 	nzFree(imapPaths), imapPaths = 0;
@@ -4480,7 +6044,7 @@ if(!fs[i]) return; // no u
 	newline[j] = '*';
 	memcpy(newline + j + 1, t, l - j);
 	newline[l + 1] = 0;
-	cnzFree(s);
+	freeLineText((pst)s);
 	cw->map[n].text = (uchar*)newline;
 }
 
@@ -4503,7 +6067,9 @@ bool mailDescend(const char *title, char cmd)
 	active_a = a, isimap = true;
 	curl_easy_setopt(h, CURLOPT_VERBOSE, (debugLevel >= 4));
 	path = cw->baseDirName;
-	f0.path = path; // that's all we need in f0
+	memset(&f0, 0, sizeof(f0));
+	f0.path = path; // that's all we need in f0, and the validity, for the cache
+	f0.uidvalidity = mailCacheValidity(path);
 
 // downloadBody has a retry feature in it
 	res = downloadBody(h, &f0, uid);
@@ -4624,8 +6190,13 @@ baddest:
 	expunge(h);
 	}
 
-	if(cmd == 'm')
+	if(cmd == 'm') {
+		int *uids = uidsFromLines(l0, l2);
+		active_a = a;
+		mailCacheForget(cw->baseDirName, uids, l2 - l0 + 1);
+		free(uids);
 		delText(l0, l2);
+	}
 	return true;
 }
 
@@ -4671,6 +6242,12 @@ bool imapDelete(int l1, int l2, char cmd)
 	nzFree(imapLines), imapLines = 0;
 	if(!rc) return false;
 	expunge(h);
+	{
+		int *uids = uidsFromLines(l0, l2);
+		active_a = a;
+		mailCacheForget(cw->baseDirName, uids, l2 - l0 + 1);
+		free(uids);
+	}
 	delText(l0, l2);
 
 D_check:
@@ -4761,6 +6338,8 @@ baddest:
 	}
 
 	if(cmd == 't') return true; // copy, nothing else to do
+	active_a = a;
+	mailCacheForget(pw->baseDirName, &uid, 1);
 
 	undoSpecialClear();
 	saveSubstitutionStrings();
@@ -4805,6 +6384,8 @@ bool imapDeleteWhileReading(void)
 	rc = tryTwice(h, pw->baseDirName, cust_cmd);
 	if(!rc) return false;
 	 expunge(h);
+	active_a = a;
+	mailCacheForget(pw->baseDirName, &uid, 1);
 
 	undoSpecialClear();
 	saveSubstitutionStrings();
@@ -1478,11 +1478,11 @@ isogo:
 			continue;
 		}
 /* Next byte has to start with 10 to be utf8, else it's iso */
-		if ((buf[i + 1] & 0xc0) != 0x80)
+		if (i + 1 >= buflen || (buf[i + 1] & 0xc0) != 0x80)
 			goto isogo;
 		c <<= 2;
 		for (j = i + 2; c&0x80; ++j, c <<= 1)
-			if ((buf[j] & 0xc0) != 0x80)
+			if (j >= buflen || (buf[j] & 0xc0) != 0x80)
 				goto isogo;
 		++utfcount;
 		i = j - 1;
@@ -2073,7 +2073,7 @@ void diagnoseAndConvert (char **rbuf_p, bool *isAllocated_p, int *partSize_p, co
 			i_puts(MSG_ConvUnix);
 		for (i = j = 0; i < *partSize_p; ++i) {
 			char c = rbuf[i];
-			if (c == '\r' && rbuf[i + 1] == '\n')
+			if (c == '\r' && i + 1 < *partSize_p && rbuf[i + 1] == '\n')
 				continue;
 			rbuf[j++] = c;
 		}
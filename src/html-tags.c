@@ -668,11 +668,9 @@ static void freeTag(Tag *t)
 
 // is a child thread downloading on behalf of this tag?
 	if(t->threadcreated && !t->threadjoined) {
-// try to stop the download
-		pthread_kill(t->loadthread, SIGINT);
-// thread has to finish before we free this tag
-// hopefully SIGINT will cause it to finish quickly, though that's not guaranteed
-		pthread_join(t->loadthread, NULL);
+// try to stop the download, or take it off the queue;
+// the fetch has to finish before we free this tag
+		fetchCancel(t);
 		t->threadjoined = true;
 	}
 
@@ -811,6 +809,192 @@ static char *readIncludeFragment(const Tag *t)
 	return a;
 }
 
+/*********************************************************************
+Preload scanner.
+htmlScanner builds the tree in one pass over the whole page,
+and it can't stop in the middle and pick up where it left off.
+So the page has to be downloaded before it is parsed.
+But we can look ahead as the page comes in, for <script src=>
+and <link rel=stylesheet>, and start fetching those,
+so they are on their way, or here, when the tree wants them.
+This is called from the curl callback on each chunk, see preloadScan()
+in http.c. It starts at off, and returns the offset to start at next time,
+which is in front of any tag or comment or script that isn't all here yet.
+A script tag may be looked at twice, which is ok,
+preloadStart() ignores a url it already has.
+This is only a guess; if the tree comes up with a different url,
+the preloaded data is not used.
+Runs in the foreground, on a page that is being browsed,
+so we can use pullAnd() to decode the entities.
+*********************************************************************/
+
+// the end of a tag, outside of quoted values
+static const char *preloadTagEnd(const char *s, const char *end)
+{
+	char c, qc = 0;
+	bool eq = false;
+	for (; s < end; ++s) {
+		c = *s;
+		if (qc) {
+			if (c == qc)
+				qc = 0;
+			continue;
+		}
+		if (c == '>')
+			return s;
+		if ((c == '"' || c == '\'') && eq) {
+			qc = c, eq = false;
+			continue;
+		}
+		if (c == '=')
+			eq = true;
+		else if (!isspaceByte(c))
+			eq = false;
+	}
+	return 0;
+}
+
+// value of the named attribute in the tag between s and end, allocated
+static char *preloadAttr(const char *s, const char *end, const char *name)
+{
+	int l = strlen(name);
+	const char *v;
+	bool match;
+	char qc;
+
+	while (s < end) {
+		if (isspaceByte(*s) || *s == '/') {
+			++s;
+			continue;
+		}
+		v = s;
+		while (s < end && !isspaceByte(*s) && *s != '=')
+			++s;
+		match = (s - v == l && memEqualCI(v, name, l));
+		while (s < end && isspaceByte(*s))
+			++s;
+		if (s == end || *s != '=')
+			continue;	// no value
+		++s;
+		while (s < end && isspaceByte(*s))
+			++s;
+		if (s < end && (*s == '"' || *s == '\'')) {
+			qc = *s++;
+			for (v = s; s < end && *s != qc; ++s) ;
+		} else {
+			for (v = s; s < end && !isspaceByte(*s); ++s) ;
+		}
+		if (match)
+			return pullAnd(v, s);
+		if (s < end)
+			++s;
+	}
+	return 0;
+}
+
+// find </name, return the < or null
+static const char *preloadClose(const char *s, const char *end, const char *name)
+{
+	int l = strlen(name);
+	while ((s = memchr(s, '<', end - s))) {
+		if (end - s < l + 2)
+			return 0;
+		if (s[1] == '/' && memEqualCI(s + 2, name, l))
+			return s;
+		++s;
+	}
+	return 0;
+}
+
+static void preloadURL(const char *url, const char *base, const char *v, bool js)
+{
+	char *a;
+	if (!*v || *v == '#' || isDataURI(v))
+		return;
+	a = resolveURL(base, v);
+	if (memEqualCI(a, "http", 4) && !fetchReplace(a) && (!js || javaOK(a)))
+		preloadStart(a, url);
+	nzFree(a);
+}
+
+int htmlPreload(const char *s, int len, int off, const char *url, char **basep)
+{
+	const char *end = s + len;
+	const char *lt, *gt, *u, *base;
+	char *v, *w;
+	int l;
+
+	for (lt = s + off; (lt = memchr(lt, '<', end - lt)); lt = gt + 1) {
+// room for the longest tag name we look for, and the character after it
+		if (end - lt < 10)
+			break;
+		if (!strncmp(lt, "<!--", 4)) {
+			for (u = lt + 4; u <= end - 3; ++u)
+				if (!memcmp(u, "-->", 3))
+					break;
+			if (u > end - 3)
+				break;
+			gt = u + 2;
+			continue;
+		}
+		for (u = lt + 1; isalphaByte(*u); ++u) ;
+		l = u - lt - 1;
+		if (!l) {
+// not a tag we care about, and perhaps not a tag at all
+			gt = lt;
+			continue;
+		}
+		if (!(gt = preloadTagEnd(u, end)))
+			break;
+		base = (*basep ? *basep : url);
+
+		if (l == 4 && memEqualCI(lt + 1, "base", 4) && !*basep) {
+			if ((v = preloadAttr(u, gt, "href"))) {
+				w = resolveURL(url, v);
+				if (isURL(w))
+					*basep = w;
+				else
+					nzFree(w);
+				nzFree(v);
+			}
+			continue;
+		}
+
+		if (l == 4 && memEqualCI(lt + 1, "link", 4)) {
+			char *rel = preloadAttr(u, gt, "rel");
+			char *type = preloadAttr(u, gt, "type");
+			if ((rel && stringEqualCI(rel, "stylesheet")) ||
+			    (type && stringEqualCI(type, "text/css"))) {
+				if ((v = preloadAttr(u, gt, "href"))) {
+					preloadURL(url, base, v, false);
+					nzFree(v);
+				}
+			}
+			nzFree(rel);
+			nzFree(type);
+			continue;
+		}
+
+// the text of a script or style is not html, skip past it
+		if ((l == 6 && memEqualCI(lt + 1, "script", 6)) ||
+		    (l == 5 && memEqualCI(lt + 1, "style", 5))) {
+			if (l == 6 && (v = preloadAttr(u, gt, "src"))) {
+				char *type = preloadAttr(u, gt, "type");
+				if (!type || !*type || strcasestr(type, "javascript") ||
+				    stringEqualCI(type, "module"))
+					preloadURL(url, base, v, true);
+				nzFree(type);
+				nzFree(v);
+			}
+			if (!(u = preloadClose(gt + 1, end, (l == 6 ? "script" : "style"))))
+				break;
+			gt = u;
+		}
+	}
+
+	return (lt ? lt - s : len);
+}
+
 // Now for the scanner, create edbrowse tags corresponding to the html tags.
 void htmlScanner(const char *htmltext, Tag *above, bool isgen)
 {
@@ -4548,7 +4732,7 @@ static void link_css(Tag *t)
 		g.thisfile = cf->fileName;
 		g.uriEncoded = true;
 		g.url = t->href;
-		if (httpConnect(&g)) {
+		if (httpConnectPreload(&g)) {
 			nzFree(g.referrer);
 			nzFree(g.cfn);
 			if (g.code == 200) {
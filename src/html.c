@@ -9,12 +9,6 @@ extern int gettimeofday(struct timeval *tp, void *tzp);
 #define SLEEP sleep
 #endif // _MSC_VER y/n
 
-// OSX has no pthread_tryjoin_np, so we can't do our
-// asynchronous timers under OSX, which is really no great loss.
-#if defined(__APPLE__) || defined(__ANDROID__) || defined(__FreeBSD__)
-#define pthread_tryjoin_np pthread_join
-#endif
-
 uchar browseLocal;
 bool showall, doColors;
 
@@ -695,13 +689,14 @@ These will use httpConnectBack2 and httpConnectBack3.
 
 3. Download javascript by background threads.
 This uses httpConnectBack2(), from prepareScript().
-The tag is passsed to the child thread and the tag must survive
-during the entire download.
+The tag is put on the fetch queue, see fetchQueue() in http.c,
+and one of a handful of worker threads runs httpConnectBack2 on it.
+The tag must survive during the entire download.
 httpConnectBack2 makes its own i_get structure on its stack.
 When parsing html, if js is enabled,
 jsNode calls prepareScript on each script tag.
 This reads the file if it is local, or fetches it if jsbg is off,
-or spawns the fetch thread if jsbg is true.
+or queues the fetch if jsbg is true.
 In the browse process, decorate is followed by run ScriptsPending.
 This function runs the scripts in the html document, or at least,
 makes sure they are loaded.
@@ -713,22 +708,29 @@ If a script is created after browse, and rooted, i.e. put into the tree,
 and if it is asynchronous, it is prepared, which starts the download process,
 and then put on a timer.
 It can run whenever it is loaded.
-If the window closes while it is loading, freeTag sends an interrupt
-signal to the child thread, then waits for it to finish,
+If the window closes while it is loading, freeTag calls fetchCancel,
+which takes the tag off the queue if it hasn't started,
+or sends an interrupt signal to the worker thread, then waits for it to finish,
 which should be almost immediate thanks to the signal.
-With the thread gone, it is safe to free the tag.
+With the fetch done, it is safe to free the tag.
 
 Note that we don't spawn threads to download the css files in background,
 though this might be worth doing, some sites have dozens of css files.
+What we do have is preloading: as the page comes in, htmlPreload()
+spots the scripts and style sheets, and the workers start fetching them,
+before the tree is built. See preloadStart() in http.c.
 
 4. Asynchronous xhr.
-A thread is created to start the fetch of the data,
-and it is put on a timer.
-The timer watches, and when the thread is done, and the data is available,
+The fetch is not queued; fetchQueue() gives it a thread of its own,
+xhrThread in http.c, which runs httpConnectBack3 on the tag.
+An xhr can take a long time, a long poll for instance,
+and it must not hold a worker that a script is waiting for.
+The tag is put on a timer.
+The timer watches, and when the fetch is done, and the data is available,
 it runs the javascript callback function on the data.
 If the window closes while the xhr data is being read,
-freeTag kills the thread, and waits for it to exit,
-as described earlier.
+freeTag calls fetchCancel, which sends an interrupt signal to the xhr thread,
+then waits until the thread marks the fetch done, as for a script.
 *********************************************************************/
 
 
@@ -831,9 +833,8 @@ void prepareScript(Tag *t)
 					jsbg = false;
 			}
 
-			if (jsbg && !demin && !uvw
-			    && !pthread_create(&t->loadthread, NULL,
-					       httpConnectBack2, (void *)t)) {
+			if (jsbg && !demin && !uvw) {
+				fetchQueue(t, false);
 				t->threadcreated = true;
 				t->js_ln = 1;
 				js_file = realsource;
@@ -847,7 +848,7 @@ void prepareScript(Tag *t)
 			g.thisfile = f->fileName;
 			g.uriEncoded = true;
 			g.url = realsource;
-			if (!httpConnect(&g)) {
+			if (!httpConnectPreload(&g)) {
 				if (debugLevel >= 3)
 					i_printf(MSG_GetJS2);
 				goto fail;
@@ -1098,7 +1099,7 @@ passes:
 
 		if (t->step == 3) {
 // waiting for background process to load
-			pthread_join(t->loadthread, NULL);
+			fetchDone(t, true);
 			t->threadjoined = true;
 			if (!t->loadsuccess || t->hcode != 200) {
 				if (debugLevel >= 3)
@@ -1813,7 +1814,7 @@ updateFieldInBuffer(int tagno, const char *newtext, bool notify, bool fromForm)
 		memcpy(new, p1, s - p1);
 		strcpy(new + (s - p1), newtext);
 		memcpy(new + strlen(new), t, plen - (t - p1));
-		free(cw->map[ln1].text);
+		freeLineText(cw->map[ln1].text);
 		cw->map[ln1].text = (pst) new;
 		if (notify && debugLevel > 0)
 			displayLine(ln1);
@@ -4080,17 +4081,7 @@ We need to fix this someday, though it is a very rare corner case.
 	if ((t = jt->t)) {
 // asynchronous script or xhr
 		if (t->step == 3) {	// background load
-			int rc =
-			    pthread_tryjoin_np(t->loadthread, NULL);
-			if (rc != 0 && rc != EBUSY) {
-// should never happen
-				debugPrint(3,
-					   "script background thread test returns %d",
-					   rc);
-				pthread_join(t->loadthread, NULL);
-				rc = 0;
-			}
-			if (!rc) {	// it's done
+			if (fetchDone(t, false)) {	// it's done
 				t->threadjoined = true;
 				if (!t->loadsuccess ||
 				(t->action == TAGACT_SCRIPT &&  t->hcode != 200)) {
@@ -4640,11 +4631,12 @@ static int ahref_under(const Tag *t)
 			if(u->href) return 1;
 		}
 		if(u->action == TAGACT_TEXT) {
-			if (u->jslink) {
-// defer to the javascript text.
+			if (u->jslink && (u->dirty || !u->textval)) {
+// defer to the javascript text, if it has changed.
 				char *w = get_property_string_t(u, "data");
 				if (w)
 					nzFree(u->textval), u->textval = w;
+				u->dirty = false;
 			}
 			const char *s = u->textval;
 			if(!s) s = emptyString;
@@ -4877,13 +4869,14 @@ nocolor:
 
 	switch (action) {
 	case TAGACT_TEXT:
-		if (t->jslink) {
-// defer to the javascript text.
-// either we query js every time, on every piece of text, as we do now,
-// or we include a setter so that TextNode.data assignment has a side effect.
+// Defer to the javascript text, but only if it has changed.
+// The TextNode.data setter notes the change, see dirtyText(),
+// so we don't have to query js on every piece of text, every time.
+		if (t->jslink && (t->dirty || !t->textval)) {
 			char *u = get_property_string_t(t, "data");
 			if (u)
 				nzFree(t->textval), t->textval = u;
+			t->dirty = false;
 		}
 		if (!t->textval)
 			break;
@@ -5562,8 +5555,10 @@ char *render(void)
 	Frame *f;
 	rowspan();
 	for (f = &cw->f0; f; f = f->next)
-		if (f->cx)
+		if (f->cx) {
 			set_property_bool_win(f, "rr$start", true);
+			dirtyText(f);
+		}
 	ns = initString(&ns_l);
 	invisible = false;
 	inv2 = NULL;
@@ -104,8 +104,108 @@ libcurl_init_fail:
 	i_printfExit(MSG_LibcurlNoInit);
 }
 
+/*********************************************************************
+A pool of curl handles, with their connections still open.
+Each easy handle keeps a cache of its connections.
+If we throw it away, the next fetch from that site pays for another
+tcp connect and tls handshake, and a page might pull 50 scripts
+and css files from the same place.
+So park the handle when the fetch is done, under scheme host and port,
+and the next fetch from that site picks it up.
+A handle is used by one thread at a time, so this is safe for the
+background threads of httpConnectBack1 2 and 3.
+We don't put connections in global_share_handle,
+because curl does not support sharing them across threads.
+*********************************************************************/
+
+#define CURLPOOLSIZE 16
+#define CURLPOOLIDLE 60		// seconds before a parked handle is closed
+#define CURLPOOLKEY (MAXPROTLEN + MAXHOSTLEN + 12)
+
+struct curlPool {
+	CURL *h;
+	char key[CURLPOOLKEY];
+	time_t parked;
+};
+static struct curlPool curlPool[CURLPOOLSIZE];
+static int curlPoolNum;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static bool curlPoolKey(const char *url, char *key)
+{
+	char prot[MAXPROTLEN], host[MAXHOSTLEN];
+	if (!url || !getProtHostURL(url, prot, host))
+		return false;
+	caseShift(prot, 'l');
+	caseShift(host, 'l');
+	sprintf(key, "%s://%s:%d", prot, host, getPortURL(url));
+	return true;
+}
+
+static CURL *curlPoolTake(const char *url)
+{
+	char key[CURLPOOLKEY];
+	CURL *h = 0;
+	time_t now;
+	int i;
+
+	if (!curlPoolKey(url, key))
+		return 0;
+	time(&now);
+	pthread_mutex_lock(&pool_mutex);
+	for (i = 0; i < curlPoolNum;) {
+		struct curlPool *p = curlPool + i;
+		if (now - p->parked > CURLPOOLIDLE) {
+			curl_easy_cleanup(p->h);
+			*p = curlPool[--curlPoolNum];
+			continue;
+		}
+		if (!h && stringEqual(p->key, key)) {
+			h = p->h;
+			*p = curlPool[--curlPoolNum];
+			continue;
+		}
+		++i;
+	}
+	pthread_mutex_unlock(&pool_mutex);
+	if (h)
+		debugPrint(4, "reuse connection %s", key);
+	return h;
+}
+
+static void curlPoolPark(CURL *h, const char *url)
+{
+	char key[CURLPOOLKEY];
+	struct curlPool *p;
+	int i;
+
+	if (!curlPoolKey(url, key)) {
+		curl_easy_cleanup(h);
+		return;
+	}
+// back to default options, but the connections stay open
+	curl_easy_reset(h);
+	pthread_mutex_lock(&pool_mutex);
+	if (curlPoolNum < CURLPOOLSIZE) {
+		p = curlPool + curlPoolNum++;
+	} else {
+// close the one that has been idle the longest
+		p = curlPool;
+		for (i = 1; i < CURLPOOLSIZE; ++i)
+			if (curlPool[i].parked < p->parked)
+				p = curlPool + i;
+		curl_easy_cleanup(p->h);
+	}
+	p->h = h;
+	strcpy(p->key, key);
+	time(&p->parked);
+	pthread_mutex_unlock(&pool_mutex);
+}
+
 void eb_curl_global_cleanup(void)
 {
+	while (curlPoolNum)
+		curl_easy_cleanup(curlPool[--curlPoolNum].h);
 	curl_easy_cleanup(global_http_handle);
 	curl_global_cleanup();
 }
@@ -298,6 +398,8 @@ static void i_get_free(struct i_get *g, bool nodata)
 	nzFree(g->urlcopy);
 	nzFree(g->cdfn);
 	nzFree(g->etag);
+	nzFree(g->preload_base);
+	g->preload_base = 0;
 	nzFree(g->newloc);
 	cnzFree(g->down_file);
 // should not be necessary, but just to be safe:
@@ -315,6 +417,10 @@ static CURLcode fetch_internet(struct i_get *g)
 	CURLcode curlret;
 	g->buffer = initString(&g->length);
 	g->headers = initString(&g->headers_len);
+// a redirect starts a new page, so start the preload scan over
+	g->preload_off = 0;
+	nzFree(g->preload_base);
+	g->preload_base = 0;
 	curlret = curl_easy_perform(g->h);
 	if (g->is_http)
 		scan_http_headers(g, false);
@@ -334,6 +440,8 @@ download states, in down_state:
 6 mime type says this should be a stream
 *********************************************************************/
 
+static void preloadScan(struct i_get *g);
+
 size_t
 eb_curl_callback(char *incoming, size_t size, size_t nitems, struct i_get * g)
 {
@@ -397,9 +505,11 @@ eb_curl_callback(char *incoming, size_t size, size_t nitems, struct i_get * g)
 
 showdots:
 	dots1 = g->length / CHUNKSIZE;
-	if (g->down_state == 0)
+	if (g->down_state == 0) {
 		stringAndBytes(&g->buffer, &g->length, incoming, num_bytes);
-	else
+		if (g->preload)
+			preloadScan(g);
+	} else
 		g->length += num_bytes;
 	dots2 = g->length / CHUNKSIZE;
 // showing dots in parallel background download threads
@@ -1421,7 +1531,10 @@ they go where they go, so this doesn't come up very often.
 curl_fail:
 	if (custom_headers)
 		curl_slist_free_all(custom_headers);
-	curl_easy_cleanup(h);
+	if (curlret == CURLE_OK)
+		curlPoolPark(h, g->urlcopy);
+	else
+		curl_easy_cleanup(h);
 	nzFree(postb);
 
 	if (curlret != CURLE_OK) {
@@ -1510,13 +1623,14 @@ void *httpConnectBack2(void *ptr)
 	bool rc;
 	struct i_get g;
 	memset(&g, 0, sizeof(g));
-	g.thisfile = cf->fileName;
+// this may run well after the tag was queued, cf could be anything by now
+	g.thisfile = (t->f0 ? t->f0->fileName : cf->fileName);
 	g.uriEncoded = true;
 	g.url = t->href;
 	g.down_force = 2;
 	g.tsn = ++tsn;
 	debugPrint(3, "jsbg thread %d", tsn);
-	rc = httpConnect(&g);
+	rc = httpConnectPreload(&g);
 	nzFree(g.cfn);
 	nzFree(g.referrer);
 	t->loadsuccess = rc;
@@ -1542,7 +1656,7 @@ void *httpConnectBack3(void *ptr)
 	struct i_get g;
 	char *outgoing_body = 0, *outgoing_headers = 0;
 	memset(&g, 0, sizeof(g));
-	g.thisfile = cf->fileName;
+	g.thisfile = (t->f0 ? t->f0->fileName : cf->fileName);
 	g.uriEncoded = true;
 	g.url = t->href;
 	g.custom_h = t->custom_h;
@@ -1585,6 +1699,423 @@ void *httpConnectBack3(void *ptr)
 	return NULL;
 }
 
+/*********************************************************************
+Scripts are fetched in the background,
+through a small scheduler, rather than a thread per resource.
+A page with 200 scripts used to spin up 200 threads,
+all hitting the network at once.
+Now the tag goes on a queue, and FETCHWORKERS threads take jobs off it,
+in order.
+Asynchronous xhr does not use the workers; it gets a thread of its own,
+as before. An xhr may be a long poll that doesn't come back for minutes,
+and a few of those would tie up the workers, or a host's share of them,
+while the page waits forever on a script queued behind them.
+No more than FETCHPERHOST fetches go to one host at a time,
+which is kind to the server, and lets the curl handle pool
+hand the open connection to the next fetch from that host.
+The workers start with the first job, and live as long as edbrowse.
+t->fetchstate is 1 queued, 2 running, 3 done,
+and t->loadthread is the worker, while it is running.
+These are guarded by fetch_mutex, and fetch_cond is broadcast
+whenever a job is queued or finished.
+If no worker thread can be created, the job runs right here.
+*********************************************************************/
+
+#define FETCHWORKERS 6
+#define FETCHPERHOST 4
+
+// a url fetched ahead of the tag that wants it, see preloadStart()
+struct preload {
+	struct preload *next;
+	char *url, *from;
+	time_t stamp;
+	uchar state;
+	bool rc;
+	struct i_get g;
+};
+
+struct fetchJob {
+	struct fetchJob *next;
+	Tag *t;
+	struct preload *p;	// instead of t, see preloadStart()
+	char host[MAXHOSTLEN];
+};
+
+static struct fetchJob *fetchList;
+static int fetchWorkers;
+static char fetchRunning[FETCHWORKERS][MAXHOSTLEN];
+static pthread_mutex_t fetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fetch_cond = PTHREAD_COND_INITIALIZER;
+
+// the next job that isn't held back by its host, mutex is held
+static struct fetchJob *fetchNext(void)
+{
+	struct fetchJob *j, **jp;
+	int i, n;
+	for (jp = &fetchList; (j = *jp); jp = &j->next) {
+		for (i = n = 0; i < FETCHWORKERS; ++i)
+			if (stringEqual(fetchRunning[i], j->host))
+				++n;
+		if (n < FETCHPERHOST) {
+			*jp = j->next;
+			return j;
+		}
+	}
+	return 0;
+}
+
+static void preloadRun(struct preload *p);
+
+static void fetchRun(struct fetchJob *j)
+{
+	if (j->p)
+		preloadRun(j->p);
+	else
+		httpConnectBack2(j->t);
+}
+
+static void *xhrThread(void *ptr)
+{
+	Tag *t = ptr;
+	httpConnectBack3(t);
+	pthread_mutex_lock(&fetch_mutex);
+	t->fetchstate = 3;
+	pthread_cond_broadcast(&fetch_cond);
+	pthread_mutex_unlock(&fetch_mutex);
+	return NULL;
+}
+
+static void *fetchWorker(void *ptr)
+{
+	int slot = (int)(long)ptr;
+	struct fetchJob *j;
+	pthread_mutex_lock(&fetch_mutex);
+	while (true) {
+		if (!(j = fetchNext())) {
+			pthread_cond_wait(&fetch_cond, &fetch_mutex);
+			continue;
+		}
+		if (j->t) {
+			j->t->fetchstate = 2;
+			j->t->loadthread = pthread_self();
+		} else
+			j->p->state = 2;
+		strcpy(fetchRunning[slot], j->host);
+		pthread_mutex_unlock(&fetch_mutex);
+		fetchRun(j);
+		pthread_mutex_lock(&fetch_mutex);
+		fetchRunning[slot][0] = 0;
+		if (j->t)
+			j->t->fetchstate = 3;
+		else
+			j->p->state = 3;
+		free(j);
+		pthread_cond_broadcast(&fetch_cond);
+	}
+	return NULL;
+}
+
+void fetchQueue(Tag *t, bool xhr)
+{
+	struct fetchJob *j, **jp;
+	pthread_t tid;
+
+	if (xhr) {
+// The mutex is held, so the thread can't finish before fetchstate is set.
+		pthread_mutex_lock(&fetch_mutex);
+		t->fetchstate = 2;
+		if (pthread_create(&t->loadthread, NULL, xhrThread, t)) {
+			pthread_mutex_unlock(&fetch_mutex);
+			httpConnectBack3(t);
+			t->fetchstate = 3;
+			return;
+		}
+		pthread_detach(t->loadthread);
+		debugPrint(4, "fetch xhr thread");
+		pthread_mutex_unlock(&fetch_mutex);
+		return;
+	}
+
+	j = allocZeroMem(sizeof(struct fetchJob));
+	j->t = t;
+	if (!getProtHostURL(t->href, 0, j->host))
+		j->host[0] = 0;
+	caseShift(j->host, 'l');
+
+	pthread_mutex_lock(&fetch_mutex);
+	while (fetchWorkers < FETCHWORKERS &&
+	       !pthread_create(&tid, NULL, fetchWorker, (void *)(long)fetchWorkers)) {
+		pthread_detach(tid);
+		++fetchWorkers;
+	}
+	if (!fetchWorkers) {
+		pthread_mutex_unlock(&fetch_mutex);
+		fetchRun(j);
+		free(j);
+		t->fetchstate = 3;
+		return;
+	}
+	for (jp = &fetchList; *jp; jp = &(*jp)->next) ;
+	j->next = *jp;
+	*jp = j;
+	t->fetchstate = 1;
+	debugPrint(4, "fetch queue script %s", j->host);
+	pthread_cond_broadcast(&fetch_cond);
+	pthread_mutex_unlock(&fetch_mutex);
+}
+
+// Is the background fetch done? Wait for it if you like.
+bool fetchDone(Tag *t, bool wait)
+{
+	bool done;
+	pthread_mutex_lock(&fetch_mutex);
+	if (wait)
+		while (t->fetchstate != 3)
+			pthread_cond_wait(&fetch_cond, &fetch_mutex);
+	done = (t->fetchstate == 3);
+	pthread_mutex_unlock(&fetch_mutex);
+	return done;
+}
+
+// The tag is going away; take it off the queue, or stop the fetch.
+void fetchCancel(Tag *t)
+{
+	struct fetchJob *j, **jp;
+	pthread_mutex_lock(&fetch_mutex);
+	if (t->fetchstate == 1) {
+		for (jp = &fetchList; (j = *jp); jp = &j->next)
+			if (j->t == t) {
+				*jp = j->next;
+				free(j);
+				break;
+			}
+		t->fetchstate = 3;
+	}
+	if (t->fetchstate == 2) {
+// hopefully SIGINT will cause it to finish quickly, though that's not guaranteed
+		pthread_kill(t->loadthread, SIGINT);
+		while (t->fetchstate != 3)
+			pthread_cond_wait(&fetch_cond, &fetch_mutex);
+	}
+	pthread_mutex_unlock(&fetch_mutex);
+}
+
+/*********************************************************************
+Preloads.
+The page is not parsed until it is all here, see htmlScanner,
+but we can look ahead as it comes in, and start fetching the scripts
+and style sheets it is going to want, see htmlPreload() in html-tags.c.
+Those fetches go through the same workers as the scripts.
+When the tree is built, and a script or a style sheet wants its url,
+httpConnectPreload() hands over the preloaded data.
+If the preload hasn't started, it is taken off the queue,
+and the caller fetches the url as usual.
+If it is running, we wait for it, it's already on its way.
+Each preload is used once. If nobody asks for it,
+the url was a bad guess, and it is thrown away after PRELOADAGE seconds.
+An older preload is never handed out; it would bypass the cache,
+and a reload, so the age is checked before the url.
+When a page or frame goes away, its unclaimed preloads go with it,
+see preloadDrop().
+A preload that is running can't be freed; its stamp is cleared,
+so it is stale, and it is freed when it is done.
+state is 1 queued, 2 running, 3 done, guarded by fetch_mutex.
+*********************************************************************/
+
+#define PRELOADAGE 60
+#define PRELOADMAX 200
+
+static struct preload *preloadList;
+static int preload_n;
+
+static void preloadRun(struct preload *p)
+{
+	struct i_get *g = &p->g;
+	g->thisfile = p->from;
+	g->uriEncoded = true;
+	g->url = p->url;
+	g->down_force = 2;
+	g->tsn = ++tsn;
+	debugPrint(3, "preload thread %d", tsn);
+	p->rc = httpConnect(g);
+}
+
+static void preloadFree(struct preload *p)
+{
+	nzFree(p->g.buffer);
+	nzFree(p->g.cfn);
+	nzFree(p->g.referrer);
+	nzFree(p->url);
+	nzFree(p->from);
+	free(p);
+}
+
+static bool preloadStale(const struct preload *p, time_t now)
+{
+	return now - p->stamp > PRELOADAGE;
+}
+
+// free the stale preloads that aren't running, mutex is held
+static void preloadExpire(time_t now)
+{
+	struct preload *p, **pp;
+	struct fetchJob *j, **jp;
+	for (pp = &preloadList; (p = *pp);) {
+		if (p->state == 2 || !preloadStale(p, now)) {
+			pp = &p->next;
+			continue;
+		}
+		if (p->state == 1) {
+			for (jp = &fetchList; (j = *jp); jp = &j->next)
+				if (j->p == p) {
+					*jp = j->next;
+					free(j);
+					break;
+				}
+		}
+		*pp = p->next;
+		--preload_n;
+		preloadFree(p);
+	}
+}
+
+// is this preload from the page name, which may have .browse on the end
+static bool preloadFrom(const struct preload *p, const char *name)
+{
+	int l = strlen(p->from);
+	return name && !strncmp(p->from, name, l) &&
+	    (!name[l] || stringEqual(name + l, ".browse"));
+}
+
+// This frame is going away, nobody will claim its preloads.
+void preloadDrop(const Frame *f)
+{
+	struct preload *p;
+	time_t now;
+	time(&now);
+	pthread_mutex_lock(&fetch_mutex);
+	for (p = preloadList; p; p = p->next)
+		if (preloadFrom(p, f->fileName) || preloadFrom(p, f->firstURL))
+			p->stamp = 0;
+	preloadExpire(now);
+	pthread_mutex_unlock(&fetch_mutex);
+}
+
+// start fetching url, which is wanted by the page from
+void preloadStart(const char *url, const char *from)
+{
+	struct preload *p;
+	struct fetchJob *j, **jp;
+	time_t now;
+	pthread_t tid;
+
+	time(&now);
+	pthread_mutex_lock(&fetch_mutex);
+	preloadExpire(now);
+	for (p = preloadList; p; p = p->next)
+		if (!preloadStale(p, now) && stringEqual(p->url, url)) {
+			pthread_mutex_unlock(&fetch_mutex);
+			return;
+		}
+	if (preload_n >= PRELOADMAX)
+		goto done;
+	while (fetchWorkers < FETCHWORKERS &&
+	       !pthread_create(&tid, NULL, fetchWorker, (void *)(long)fetchWorkers)) {
+		pthread_detach(tid);
+		++fetchWorkers;
+	}
+// don't preload in the foreground, that would only slow things down
+	if (!fetchWorkers)
+		goto done;
+
+	p = allocZeroMem(sizeof(struct preload));
+	p->url = cloneString(url);
+	p->from = cloneString(from);
+	p->stamp = now;
+	p->state = 1;
+	p->next = preloadList;
+	preloadList = p;
+	++preload_n;
+
+	j = allocZeroMem(sizeof(struct fetchJob));
+	j->p = p;
+	if (!getProtHostURL(url, 0, j->host))
+		j->host[0] = 0;
+	caseShift(j->host, 'l');
+	for (jp = &fetchList; *jp; jp = &(*jp)->next) ;
+	j->next = *jp;
+	*jp = j;
+	debugPrint(3, "preload %s", url);
+	pthread_cond_broadcast(&fetch_cond);
+done:
+	pthread_mutex_unlock(&fetch_mutex);
+}
+
+// httpConnect, but use the preloaded data if we have it.
+bool httpConnectPreload(struct i_get *g)
+{
+	struct preload *p, **pp;
+	struct fetchJob *j, **jp;
+	time_t now;
+	bool rc;
+
+	time(&now);
+	pthread_mutex_lock(&fetch_mutex);
+	preloadExpire(now);
+	for (pp = &preloadList; (p = *pp); pp = &p->next)
+		if (!preloadStale(p, now) && stringEqual(p->url, g->url))
+			break;
+	if (!p) {
+		pthread_mutex_unlock(&fetch_mutex);
+		return httpConnect(g);
+	}
+	*pp = p->next;
+	--preload_n;
+	if (p->state == 1) {
+// not started, take it off the queue and fetch it here
+		for (jp = &fetchList; (j = *jp); jp = &j->next)
+			if (j->p == p) {
+				*jp = j->next;
+				free(j);
+				break;
+			}
+		pthread_mutex_unlock(&fetch_mutex);
+		preloadFree(p);
+		return httpConnect(g);
+	}
+	while (p->state != 3)
+		pthread_cond_wait(&fetch_cond, &fetch_mutex);
+	pthread_mutex_unlock(&fetch_mutex);
+
+	debugPrint(3, "preloaded %s", g->url);
+	rc = p->rc;
+	g->buffer = p->g.buffer, g->length = p->g.length;
+	g->code = p->g.code;
+	g->hcl = p->g.hcl;
+	strcpy(g->content, p->g.content);
+	if (p->g.charset)
+		g->charset = g->content + (p->g.charset - p->g.content);
+	g->cfn = p->g.cfn;
+	g->referrer = p->g.referrer;
+	p->g.buffer = p->g.cfn = p->g.referrer = 0;
+	preloadFree(p);
+	return rc;
+}
+
+// called from the curl callback, on each chunk of a page that will be browsed
+static void preloadScan(struct i_get *g)
+{
+	long code = 0;
+	if (!stringEqual(g->content, "text/html") || !g->urlcopy)
+		return;
+	curl_easy_getinfo(g->h, CURLINFO_RESPONSE_CODE, &code);
+	if (code != 200)
+		return;
+	g->preload_off =
+	    htmlPreload(g->buffer, g->length, g->preload_off, g->urlcopy,
+			&g->preload_base);
+}
+
 // copy text over to the buffer but change < to &lt; etc,
 // since this data will be browsed as if it were html.
 static void prepHtmlString(struct i_get *g, const char *q)
@@ -2435,7 +2966,9 @@ static CURL *http_curl_init(struct i_get *g)
 {
 	CURLcode curl_init_status = CURLE_OK;
 	int curl_auth;
-	CURL *h = curl_easy_init();
+	CURL *h = curlPoolTake(g->url);
+	if (!h)
+		h = curl_easy_init();
 	if (h == NULL)
 		goto libcurl_init_fail;
 	g->h = h;
@@ -2710,6 +3243,15 @@ curl_header_callback(char *header_line, size_t size, size_t nmemb,
 	stringAndBytes(&g->headers, &g->headers_len,
 		       header_line, bytes_in_line);
 
+// Curl puts these cookies in its jar; our index of the jar is out of date.
+// Wait for the blank line, so curl has seen every Set-Cookie in the response.
+	if (bytes_in_line > 11 && memEqualCI(header_line, "set-cookie:", 11))
+		g->setcookie = true;
+	if (g->setcookie && (*header_line == '\r' || *header_line == '\n')) {
+		g->setcookie = false;
+		cookiesChanged();
+	}
+
 	scan_http_headers(g, true);
 
 // a from-the-web mime type causes a download interrupt
@@ -2790,11 +3332,14 @@ ebcurl_debug_handler(CURL * handle, curl_infotype info_desc, char *data,
 	    size > 17 && !strncmp(data, "* CAPABILITY IMAP", 17)) {
 		char *s;
 // data may not be null terminated; can't use strstr
-		for (s = data; s < data + size - 6; ++s)
-			if (!strncmp(s, " MOVE", 5) && isspaceByte(s[5])) {
+		for (s = data; s < data + size - 6; ++s) {
+			if (!strncmp(s, " MOVE", 5) && isspaceByte(s[5]))
 				g->move_capable = true;
-				break;
-			}
+// QRESYNC implies CONDSTORE
+			if (s < data + size - 10 &&
+			    (!strncmp(s, " CONDSTORE", 10) || !strncmp(s, " QRESYNC", 8)))
+				g->condstore = true;
+		}
 	}
 	if (debugLevel < 4)
 		return 0;
@@ -3371,6 +3916,7 @@ bool reexpandFrame(void)
 
 	delTimers(cf);
 	freeJSContext(cf);
+	preloadDrop(cf);
 	nzFree(cf->dw);
 	cf->dw = 0;
 	nzFree(cf->hbase);
@@ -26,6 +26,12 @@ The edbrowse wiki has many examples.
 
 #include "eb.h"
 
+#include <sys/file.h>
+#include <sys/time.h>
+#include <dirent.h>
+#include <zlib.h>
+#include <openssl/sha.h>
+
 struct PROTOCOL {
 	const char prot[MAXPROTLEN];
 	int port;
@@ -1398,6 +1404,7 @@ struct cookie {
 	bool secure;
 	bool fromjar;
 	time_t expires;		/* zero means undefined */
+	struct cookie *hnext;	/* chain in the cookie index */
 };
 
 static const char *httponly_prefix = "#HttpOnly_";
@@ -1670,6 +1677,7 @@ bool receiveCookie(const char *url, const char *str)
 	}
 
 	cookieForLibcurl(c);
+	cookiesChanged();
 	freeCookie(c);
 	nzFree(c);
 	return true;
@@ -1748,6 +1756,7 @@ void cookiesFromJar(void)
 
 	foreach(c, cookies)
 	    cookieForLibcurl(c);
+	cookiesChanged();
 
 // Free the resources allocated by this routine.
 	foreach(c, cookies)
@@ -1788,82 +1797,160 @@ that logic so I have to rewrite it all here. Ugh!
 I need it for javascript  document.cookie, which returns all the cookies
 that belong to this web page, including any new cookies that were
 added during this edbrowse session, e.g. document.cookie = newCookie;
+-
+There could be thousands of cookies, and a page can read document.cookie
+hundreds of times, so we don't want to ask curl for the whole list
+and parse every line, every time.
+Instead, keep an index of the cookies in curl space,
+hashed on the last two components of the domain, example.com for
+www.example.com or .example.com. That is the registrable domain, or something
+broader, as in co.uk, and a cookie can only match a host with the same key.
+The only exception is a one word domain, like localhost,
+which could tail match a.localhost, so we look under both keys.
+Curl is still the keeper of the cookies, we only read them.
+The index is marked stale when the set changes, cookiesChanged(),
+and rebuilt on the next lookup, that is, once per change, not once per lookup.
+Curl adds cookies on its own, from Set-Cookie headers,
+so the header callback in http.c marks the index stale when it sees one.
+The index is shared by all the threads, under cookie_mex.
 *********************************************************************/
 
+#define COOKIEHASH 256
+static struct cookie *cookieIndex[COOKIEHASH];
+static bool cookiesStale = true;
+static pthread_mutex_t cookie_mex = PTHREAD_MUTEX_INITIALIZER;
+
+void cookiesChanged(void)
+{
+	pthread_mutex_lock(&cookie_mex);
+	cookiesStale = true;
+	pthread_mutex_unlock(&cookie_mex);
+}
+
+// the last two components of the domain, or one if that's all there is
+static const char *cookieKey(const char *d, int ncomp)
+{
+	const char *s = d + strlen(d);
+	while (s > d) {
+		if (s[-1] == '.' && !--ncomp)
+			break;
+		--s;
+	}
+	if (*s == '.')
+		++s;
+	return s;
+}
+
+static unsigned cookieHash(const char *key)
+{
+	unsigned h = 0;
+	while (*key)
+		h = h * 31 + (uchar) tolower(*key++);
+	return h % COOKIEHASH;
+}
+
+static void cookieIndexBuild(void)
+{
+	struct curl_slist *known_cookies = NULL, *cursor;
+	struct cookie *c, **tails[COOKIEHASH];
+	int i, n = 0;
+
+	for (i = 0; i < COOKIEHASH; ++i) {
+		while ((c = cookieIndex[i])) {
+			cookieIndex[i] = c->hnext;
+			freeCookie(c);
+			nzFree(c);
+		}
+		tails[i] = cookieIndex + i;
+	}
+
+// Clear the flag first; if curl adds a cookie while we're reading the list,
+// the index will be rebuilt next time.
+	cookiesStale = false;
+	curl_easy_getinfo(global_http_handle, CURLINFO_COOKIELIST,
+			  &known_cookies);
+	for (cursor = known_cookies; cursor; cursor = cursor->next) {
+		c = cookie_from_netscape_line(cursor->data);
+		if (c == NULL)	/* didn't read a cookie line. */
+			continue;
+/* HttpOnly cookies *never ever ever* get passed to JavaScript. */
+		if (!strncmp(c->domain, httponly_prefix, httponly_prefix_len)) {
+			freeCookie(c);
+			nzFree(c);
+			continue;
+		}
+// keep curl's order within each chain
+		i = cookieHash(cookieKey(c->domain, 2));
+		*tails[i] = c;
+		tails[i] = &c->hnext;
+		++n;
+	}
+	if (known_cookies != NULL)
+		curl_slist_free_all(known_cookies);
+	debugPrint(4, "cookie index %d cookies", n);
+}
+
 void findcookies(char **s, int *l, const char *url, bool issecure)
 {
 	const char *server = getHostURL(url);
 	const char *data = getDataURL(url);
 	int nc = 0;		/* new cookie */
-	struct cookie *c = NULL;
+	struct cookie *c;
 	time_t now;
-	struct curl_slist *known_cookies = NULL;
-	struct curl_slist *cursor = NULL;
+	const char *key, *lastkey = 0;
+	int k;
 
 	if (!curlActive)
 		return;
 	if (!url || !server || !data)
 		return;
 
-	curl_easy_getinfo(global_http_handle, CURLINFO_COOKIELIST,
-			  &known_cookies);
-
 	if (data > url && data[-1] == '/')
 		data--;
 	if (!*data)
 		data = "/";
 	time(&now);
 
-/* Can't use foreach here, since known_cookies is just a pointer. */
-	cursor = known_cookies;
+	pthread_mutex_lock(&cookie_mex);
+	if (cookiesStale)
+		cookieIndexBuild();
 
-/* The code at the top of the loop guards against a memory leak.
- * Otherwise, structs could become inaccessible after continue statements. */
-	while (cursor != NULL) {
-		if (c != NULL) {	/* discard un-freed cookie structs */
-			freeCookie(c);
-			nzFree(c);
-		}
-		c = cookie_from_netscape_line(cursor->data);
-		cursor = cursor->next;
-		if (c == NULL)	/* didn't read a cookie line. */
-			continue;
-/* This next test is technically redundant, but let's be clear that
- * HttpOnly cookies *never ever ever* get passed to JavaScript...
- */
-		if (!strncmp(c->domain, httponly_prefix, httponly_prefix_len))
-			continue;
-		if(c->tail) {
-			if (!isInDomain(c->domain, server))
+	for (k = 2; k >= 1; --k) {
+		key = cookieKey(server, k);
+		if (lastkey && stringEqual(key, lastkey))
+			break;
+		lastkey = key;
+		for (c = cookieIndex[cookieHash(key)]; c; c = c->hnext) {
+// other keys hash to this chain, and the same cookie could come up
+// under both keys, so make sure this cookie belongs to this key.
+			if (!stringEqualCI(cookieKey(c->domain, 2), key))
 				continue;
-		} else {
-			if(!stringEqualCI(c->domain, server))
+			if(c->tail) {
+				if (!isInDomain(c->domain, server))
+					continue;
+			} else {
+				if(!stringEqualCI(c->domain, server))
+					continue;
+			}
+			if (!isPathPrefix(c->path, data))
+				continue;
+			if (c->expires && c->expires < now)
+				continue;
+			if (c->secure && !issecure)
 				continue;
-		}
-		if (!isPathPrefix(c->path, data))
-			continue;
-		if (c->expires && c->expires < now)
-			continue;
-		if (c->secure && !issecure)
-			continue;
 /* We're good to go. */
-		if (!nc)
-			stringAndString(s, l, "Cookie: "), nc = 1;
-		else
-			stringAndString(s, l, "; ");
-		stringAndString(s, l, c->name);
-		stringAndChar(s, l, '=');
-		stringAndString(s, l, c->value);
-		debugPrint(3, "find cookie %s=%s", c->name, c->value);
-	}
-
-	if (c != NULL) {
-		freeCookie(c);
-		nzFree(c);
+			if (!nc)
+				stringAndString(s, l, "Cookie: "), nc = 1;
+			else
+				stringAndString(s, l, "; ");
+			stringAndString(s, l, c->name);
+			stringAndChar(s, l, '=');
+			stringAndString(s, l, c->value);
+			debugPrint(3, "find cookie %s=%s", c->name, c->value);
+		}
 	}
+	pthread_mutex_unlock(&cookie_mex);
 
-	if (known_cookies != NULL)
-		curl_slist_free_all(known_cookies);
 	if (nc)
 		stringAndString(s, l, eol);
 }
@@ -1973,7 +2060,7 @@ void mergeCookies(void)
 	for (i = 0; i < nc; ++i) {
 		c = a[i];
 		if (c->fromjar)
-			cookieForLibcurl(c);
+			cookieForLibcurl(c), cookiesChanged();
 // skip past duplicates of this cookie.
 		while (true) {
 			if (i == nc - 1)
@@ -1997,17 +2084,20 @@ void mergeCookies(void)
 /*********************************************************************
 Maintain a cache of the http files.
 The url is the key.
-The result is a string that holds a 5 digit filename, the etag,
+The result is a string that holds a filename, the etag,
 last modified time, last access time, and file size.
-nnnnn tab etag tab last-mod tab access tab size
+file tab etag tab last-mod tab access tab size
+The file is a 5 digit number, or, with cachestore = zip,
+z followed by the sha256 of the data, in hex.
+That file is compressed, and shared by every url with the same data.
 The access time helps us clean house; delete the oldest files.
 If you change the format of this file in any way, increment the version number.
 Previous cache files will be left hanging around, but oh well.
 Not expecting to change this file format very often.
 cacheDir is the directory holding the cached files,
 and cacheControl is the file that houses the database.
-I open a lock file with O_EXCL when accessing the cache,
-and if busy then I wait a few milliseconds and try again.
+Access is controlled by flock on a lock file, shared for readers,
+exclusive for writers; see setLock() below.
 If the stored etag and header etag are both present, and don't match,
 then the file is stale.
 If one or the other etag is missing, and mod time website > mod time cached,
@@ -2015,31 +2105,160 @@ then the file is stale.
 We don't even query the cache if we don't have at least one of etag or mod time.
 *********************************************************************/
 
-#define CACHECONTROLVERSION 1
+#define CACHECONTROLVERSION 2
 
 #define USLEEP(a) usleep(a)	// sleep microsecs
 
 static int control_fh = -1;	/* file handle for cacheControl */
-static char *cache_data;
+static int lock_fh = -1;	/* file handle for cacheLock, we flock this */
 static time_t now_t;
-static char *cacheFile, *cacheLock, *cacheControl;
+static char *cacheFile, *cacheLock, *cacheControl, *cacheControlTemp;
 
 /* a cache entry */
 struct CENTRY {
 	off_t offset;
 	size_t textlength;
-	const char *url;
-	int filenumber;
-	const char *etag;
+	char *url;
+	char *file;
+	char *etag;
 	int modtime;
 	int accesstime;
 	int pages;		/* in 4K pages */
+	int group;		// scratch, used while pruning
+	bool touched;		// access time not yet written
 };
 
 static struct CENTRY *entries;
-static int numentries;
+static int numentries, maxentries;
 static pthread_mutex_t inside_mex;
 
+/*********************************************************************
+The parsed control file stays in memory from one call to the next.
+We remember the inode, size, and mod time of the control file;
+if none of these have changed, what we have is still good.
+If only the size has grown, another edbrowse appended some records,
+so read and apply just those.
+Anything else, and we read the whole file again.
+Records are appended as a journal; a later record for a url overrides
+an earlier one. journalLines counts all the records in the file,
+and when it gets to be twice the number of entries,
+writeControl() compacts the file.
+Entries are found through a hash table on the url,
+normalized the way sameURL() compares them.
+The table holds entry number + 1, 0 is an empty slot.
+*********************************************************************/
+
+static struct stat control_st;
+static bool control_valid;
+static int journalLines;
+static int *cacheHash;
+static int cacheHashSize;
+
+static unsigned urlHashKey(const char *url)
+{
+	const char *p, *u, *post;
+	unsigned h = 5381;
+	post = strchr(url, '\1');
+	p = (post ? post : url + strlen(url));
+	if ((u = findHash(url)))
+		p = u;
+	if (memEqualCI(url, "http://", 7))
+		url += 7;
+	if (!*p && p - url >= 7 && stringEqual(p - 7, ".browse"))
+		p -= 7;
+	if (p > url && p[-1] == '/') {
+		u = strpbrk(url, "?#\1");
+		if (!u || u >= p)
+			--p;
+	}
+	for (; url < p; ++url)
+		h = h * 33 + (uchar) * url;
+	if (post)
+		for (; *post; ++post)
+			h = h * 33 + (uchar) * post;
+	return h;
+}
+
+static void cacheHashAdd(int n)
+{
+	unsigned h = urlHashKey(entries[n].url) & (cacheHashSize - 1);
+	while (cacheHash[h])
+		h = (h + 1) & (cacheHashSize - 1);
+	cacheHash[h] = n + 1;
+}
+
+static void cacheHashBuild(void)
+{
+	int i;
+	int size = 1024;
+	while (size < maxentries * 2)
+		size <<= 1;
+	nzFree(cacheHash);
+	cacheHash = allocZeroMem(size * sizeof(int));
+	cacheHashSize = size;
+	for (i = 0; i < numentries; ++i)
+		cacheHashAdd(i);
+}
+
+static struct CENTRY *cacheFind(const char *url)
+{
+	unsigned h;
+	int n;
+	if (!cacheHash)
+		return 0;
+	h = urlHashKey(url) & (cacheHashSize - 1);
+	while ((n = cacheHash[h])) {
+		if (sameURL(url, entries[n - 1].url))
+			return entries + n - 1;
+		h = (h + 1) & (cacheHashSize - 1);
+	}
+	return 0;
+}
+
+static struct CENTRY *newEntry(const char *url)
+{
+	struct CENTRY *e;
+	if (numentries == maxentries) {
+		maxentries = (maxentries ? maxentries * 2 : cacheCount);
+		entries = reallocMem(entries, maxentries * sizeof(struct CENTRY));
+		cacheHashBuild();
+	}
+	e = entries + numentries;
+	memset(e, 0, sizeof(struct CENTRY));
+	e->url = cloneString(url);
+	e->etag = emptyString;
+	cacheHashAdd(numentries++);
+	return e;
+}
+
+static void freeEntries(void)
+{
+	struct CENTRY *e = entries;
+	int i;
+	for (i = 0; i < numentries; ++i, ++e) {
+		nzFree(e->url);
+		nzFree(e->file);
+		nzFree(e->etag);
+	}
+	numentries = 0;
+	journalLines = 0;
+	if (cacheHash)
+		memset(cacheHash, 0, cacheHashSize * sizeof(int));
+	control_valid = false;
+}
+
+static void setEtag(struct CENTRY *e, const char *etag)
+{
+	nzFree(e->etag);
+	e->etag = (etag && *etag ? cloneString(etag) : emptyString);
+}
+
+// remember the state of the control file after we read or write it
+static void noteControl(void)
+{
+	control_valid = (fstat(control_fh, &control_st) == 0);
+}
+
 void setupEdbrowseCache(void)
 {
 	int fh;
@@ -2051,6 +2270,10 @@ void setupEdbrowseCache(void)
 		close(control_fh);
 		control_fh = -1;
 	}
+	if (lock_fh >= 0) {
+		close(lock_fh);
+		lock_fh = -1;
+	}
 	if (!cacheDir) {
 // this should always happen
 		cacheDir = allocMem(strlen(home) + 10);
@@ -2076,30 +2299,26 @@ void setupEdbrowseCache(void)
 		close(fh);
 
 	nzFree(cacheLock);
-	cacheLock = allocMem(strlen(cacheDir) + 6);
-	sprintf(cacheLock, "%s/lock", cacheDir);
+	cacheLock = allocMem(strlen(cacheDir) + 7);
+	sprintf(cacheLock, "%s/flock", cacheDir);
+
+	nzFree(cacheControlTemp);
+	cacheControlTemp = allocMem(strlen(cacheControl) + 5);
+	sprintf(cacheControlTemp, "%s.tmp", cacheControl);
 
 	nzFree(cacheFile);
-	cacheFile = allocMem(strlen(cacheDir) + 7);
+	cacheFile = allocMem(strlen(cacheDir) + 80);
 
-	nzFree(entries);
-	entries = allocMem(cacheCount * sizeof(struct CENTRY));
+	freeEntries();
 }
 
 /*********************************************************************
-Read the control file into memory and parse it into entry structures.
-Sadly, I do this every time you access the cache.
-It would be better to hold all this data in memory, with the time stamp of the
-control file, and if the control file has not been updated
-then just use what we have;
-and if it has been updated then read it and parse it.
-Well maybe we'll implement this later.
-For now, the control file isn't too big, it's not prohibitive
-to do this every time.
+Read the control file, or the part of it past byte from,
+and apply the records to the entries in memory.
 Note that control is a nice ascii readable file, helps with debugging.
 *********************************************************************/
 
-static bool readControl(void)
+static bool readControl(off_t from)
 {
 	char *s, *t, *endfile;
 	char *data;
@@ -2107,14 +2326,15 @@ static bool readControl(void)
 	struct CENTRY *e;
 	int ln = 1;
 
-	lseek(control_fh, 0L, 0);
+	if (!from)
+		freeEntries();
+	lseek(control_fh, from, 0);
 	if (!fdIntoMemory(control_fh, &data, &datalen, 0))
 		return false;
 
-	numentries = 0;
-	e = entries;
 	endfile = data + datalen;
 	for (s = data; s != endfile; s = t, ++ln) {
+		char *rec = s, *url, *file, *etag;
 		t = strchr(s, '\n');
 		if (!t) {
 // file does not end in newline; this should never happen!
@@ -2122,105 +2342,276 @@ static bool readControl(void)
 			break;
 		}
 		++t;
-		e->offset = s - data;
-		e->textlength = t - s;
-		e->url = s;
+		url = s;
 		s = strchr(s, '\t');
 		if (!s || s >= t) {
 			debugPrint(3, "cache control file line %d is bogus", ln);
 			continue;
 		}
 		*s++ = 0;
-		e->filenumber = strtol(s, &s, 10);
-		++s;
-		e->etag = s;
+		file = s;
+		s = strchr(s, '\t');
+		if (!s || s >= t) {
+			debugPrint(3, "cache control file line %d is bogus", ln);
+			continue;
+		}
+		*s++ = 0;
+		etag = s;
 		s = strchr(s, '\t');
 		if (!s || s >= t) {
 			debugPrint(3, "cache control file line %d is bogus", ln);
 			continue;
 		}
 		*s++ = 0;
-		sscanf(s, "%d %d %d", &e->modtime, &e->accesstime, &e->pages);
-		++e, ++numentries;
+		if (!(e = cacheFind(url)))
+			e = newEntry(url);
+		e->offset = from + (rec - data);
+		e->textlength = t - rec;
+		nzFree(e->file);
+		e->file = cloneString(file);
+		setEtag(e, etag);
+		{
+			int a = e->accesstime;
+			sscanf(s, "%d %d %d", &e->modtime, &e->accesstime, &e->pages);
+// our own access time, not yet written, may be more recent
+			if (e->touched && a > e->accesstime)
+				e->accesstime = a;
+		}
+		++journalLines;
 	}
 
-	cache_data = data;	/* remember to free this later */
+	nzFree(data);
+	noteControl();
+	debugPrint(4, "cache control read from %lld, %d entries",
+		   (long long)from, numentries);
 	return true;
 }
 
+// Bring the entries up to date with the control file, if need be.
+static bool refreshControl(void)
+{
+	struct stat st, st2;
+// another edbrowse may have rewritten the file and renamed it into place
+	if (control_fh >= 0 &&
+	    (stat(cacheControl, &st) || fstat(control_fh, &st2) ||
+	     st.st_ino != st2.st_ino)) {
+		close(control_fh);
+		control_fh = -1;
+	}
+	if (control_fh < 0) {
+		control_fh = open(cacheControl, O_RDWR | O_BINARY | O_CLOEXEC, 0);
+		if (control_fh < 0)
+			return false;
+		control_valid = false;
+	}
+	if (fstat(control_fh, &st))
+		return false;
+	if (control_valid && st.st_ino == control_st.st_ino) {
+		if (st.st_size == control_st.st_size &&
+		    st.st_mtime == control_st.st_mtime &&
+		    st.st_mtim.tv_nsec == control_st.st_mtim.tv_nsec)
+			return true;
+		if (st.st_size > control_st.st_size)
+			return readControl(control_st.st_size);
+	}
+	return readControl(0);
+}
+
 /* create an ascii equivalent for a record, this is allocated */
 static char *record2string(const struct CENTRY *e)
 {
 	char *t;
-	ignore = asprintf(&t, "%s\t%05d\t%s\t%d\t%d\t%d\n",
-		 e->url, e->filenumber, e->etag, e->modtime, e->accesstime,
+	ignore = asprintf(&t, "%s\t%s\t%s\t%d\t%d\t%d\n",
+		 e->url, e->file, e->etag, e->modtime, e->accesstime,
 		 e->pages);
 	return t;
 }
 
-/* ON a rare occasion we will have to rewrite the entire control file.
- * If this fails, and it shouldn't, then our only recourse is to clear the cache.
- * If successful, then the file is closed. */
+/* Rewrite the entire control file, when the cache is pruned,
+ * or when the journal has grown too long.
+ * The new file is written alongside and renamed into place,
+ * so another edbrowse sees a new inode and reads it from the top.
+ * If this fails, and it shouldn't, then our only recourse is to clear the cache. */
 static bool writeControl(void)
 {
 	struct CENTRY *e;
-	int i;
+	int i, fh;
+	off_t offset = 0;
 	FILE *f;
 
-	if(control_fh < 0) {
-// This should never happen, but I saw it happen once.
-// See the comments just before setLock().
-		control_fh =     open(cacheControl, O_RDWR | O_BINARY | O_CLOEXEC, 0);
-		if (control_fh < 0) {
-			truncate0(cacheControl, -1);
-			return false;
-		}
-	}
-
-	lseek(control_fh, 0L, 0);
-	truncate0(cacheControl, control_fh);
+	fh = open(cacheControlTemp, O_WRONLY | O_TRUNC | O_CREAT | O_BINARY | O_CLOEXEC, MODE_private);
+	if (fh < 0)
+		return false;
 /* buffered IO is more efficient */
-	f = fdopen(control_fh, "w");
+	f = fdopen(fh, "w");
 
 	e = entries;
 	for (i = 0; i < numentries; ++i, ++e) {
 		int rc;
 		char *newrec = record2string(e);
+		e->touched = false;
 		e->textlength = strlen(newrec);
+		e->offset = offset;
+		offset += e->textlength;
 		rc = fprintf(f, "%s", newrec);
 		free(newrec);
 		if (rc <= 0) {
 			fclose(f);
-			control_fh = -1;
-			truncate0(cacheControl, -1);
+			unlink(cacheControlTemp);
 			return false;
 		}
 	}
 
-	fclose(f);
-	control_fh = -1;
+	if (fclose(f) || rename(cacheControlTemp, cacheControl)) {
+		unlink(cacheControlTemp);
+		return false;
+	}
+
+	if (control_fh >= 0)
+		close(control_fh);
+	control_fh = open(cacheControl, O_RDWR | O_BINARY | O_CLOEXEC, 0);
+	if (control_fh < 0)
+		return false;
+	journalLines = numentries;
+	noteControl();
 	return true;
 }
 
+/* Append the record for this entry to the journal,
+ * or rewrite the file if the journal is getting long.
+ * Records are never written in place; another edbrowse reads
+ * just what was appended, see refreshControl().
+ * This requires the exclusive lock. */
+static bool updateControl(struct CENTRY *e)
+{
+	char *newrec = record2string(e);
+	size_t newlen = strlen(newrec);
+	off_t end;
+	bool rc = true;
+
+	e->touched = false;
+	if (journalLines >= 2 * numentries + 100) {
+		rc = writeControl();
+		goto done;
+	}
+
+	end = lseek(control_fh, 0L, 2);
+	if (write(control_fh, newrec, newlen) < (int)newlen) {
+		rc = writeControl();
+		goto done;
+	}
+	e->offset = end;
+	e->textlength = newlen;
+	++journalLines;
+
+done:
+	free(newrec);
+	if (rc)
+		noteControl();
+	return rc;
+}
+
+// Write the access times that readers left in memory.
+static bool writeTouched(void)
+{
+	struct CENTRY *e = entries;
+	int i, n = 0;
+	for (i = 0; i < numentries; ++i, ++e) {
+		if (!e->touched)
+			continue;
+		if (!updateControl(e))
+			return false;
+		++n;
+	}
+	if (n)
+		debugPrint(4, "cache access times written, %d", n);
+	return true;
+}
+
+// Is this file used by an entry other than skip?
+static bool fileShared(const char *file, const struct CENTRY *skip)
+{
+	const struct CENTRY *e = entries;
+	int i;
+	for (i = 0; i < numentries; ++i, ++e)
+		if (e != skip && stringEqual(e->file, file))
+			return true;
+	return false;
+}
+
 /* create a file number to fold into the file name.
  * This is chosen at random. At worst we should get
  * an unused number in 2 or 3 tries. */
-static int generateFileNumber(void)
+static void generateFileNumber(char *name)
 {
-	struct CENTRY *e;
-	int i, n;
-
 	while (true) {
-		n = rand() % 100000;
-		e = entries;
-		for (i = 0; i < numentries; ++i, ++e)
-			if (e->filenumber == n)
-				break;
-		if (i == numentries)
-			return n;
+		sprintf(name, "%05d", rand() % 100000);
+		if (!fileShared(name, 0))
+			return;
 	}
 }
 
+// The name of a compressed cache file, from the sha256 of its data.
+static void zipFileName(const char *data, int datalen, char *name)
+{
+	uchar md[SHA256_DIGEST_LENGTH];
+	int i;
+	SHA256((const uchar *)data, datalen, md);
+	*name = 'z';
+	for (i = 0; i < SHA256_DIGEST_LENGTH; ++i)
+		sprintf(name + 1 + 2 * i, "%02x", md[i]);
+}
+
+/* Write compressed data to a cache file.
+ * It goes to a temp file first, then renamed into place,
+ * because a file of this name is trusted to hold this data. */
+static bool zipOutToFile(const char *filename, const char *data, int datalen)
+{
+	char *temp;
+	gzFile gz;
+	bool rc = false;
+	if (asprintf(&temp, "%s.tmp", filename) < 0)
+		return false;
+	gz = gzopen(temp, "wb6");
+	if (!gz)
+		goto done;
+	if (datalen && gzwrite(gz, data, datalen) != datalen) {
+		gzclose(gz);
+		goto done;
+	}
+	if (gzclose(gz) != Z_OK)
+		goto done;
+	rc = !rename(temp, filename);
+done:
+	if (!rc)
+		unlink(temp);
+	free(temp);
+	return rc;
+}
+
+static bool zipIntoMemory(const char *filename, char **data, int *datalen)
+{
+	char chunk[8192];
+	char *buf;
+	int buflen, n;
+	gzFile gz = gzopen(filename, "rb");
+	if (!gz)
+		return false;
+	buf = initString(&buflen);
+	while ((n = gzread(gz, chunk, sizeof(chunk))) > 0)
+		stringAndBytes(&buf, &buflen, chunk, n);
+	if (n < 0) {
+		debugPrint(3, "cache file %s is corrupt", filename);
+		gzclose(gz);
+		nzFree(buf);
+		return false;
+	}
+	gzclose(gz);
+	*data = buf;
+	*datalen = buflen;
+	return true;
+}
+
 /*********************************************************************
 If jsbg is active, a dozen threads could be downloading scripts in parallel.
 That is efficient, but tricky.
@@ -2228,30 +2619,25 @@ curl is threadsafe, thanks to each job having its own curl handle.
 If we're careful with httpConnect(), that should be no trouble.
 However, each job might try to access the cache to obtain this file,
 or store it in the cache when fetched from the internet.
-Thus we need a mutex to control access to the cache.
-You already saw this; it is inside_mex above.
-But that's not good enough.
 Multiple edbrowse processes could be running, perhaps on different consoles,
-and they all need exclusive access to the cache.
-So I do something I've been doing since 1982, when that was the only option.
-open(lockfile, ... O_EXCL);
-The lockfile is in the cache with the other files.
-There might be a better way to do this, like ipc semaphore, but hey,
-those didn't exist in 1982, and I'm an old dog.
-So there we have it, the combination of mutex and open(O_EXCL).
-Now with that in mind, why not just use the lockfile?
-Why do we also need the mutex?
-Because once, just once, after using edbrowse cache heavily for ten years,
-I saw the lockfile mechanism break through.
-It's an exclusive create, but apparently not guaranteed to be a mutex in the OS.
-If you race down to the microsecond, two threads can both test
-for the file, see it is not there, and then create it.
-Yeah I'm surprised too, but I saw it happen and it generated a core dump.
-Thank goodness I always run with symbols, so I could debug it with gdb,
-cause I'm never going to create that race condition again.
-So I use both mechanisms.
-Also, there is a check in writeControl, so if there is another breakthrough,
-ever again, it won't generate a seg fault.
+and they all share the cache as well.
+Between processes, we flock the lock file in the cache directory.
+Fetching from the cache, or asking if a url is present, takes a shared lock,
+so any number of edbrowse processes can read the cache at once.
+Storing in the cache, or clearing it, takes an exclusive lock.
+A reader doesn't write at all, not even the access time.
+That is kept in memory, and appended to the control file
+the next time this process holds the exclusive lock, see writeTouched().
+If a reader wrote it in place, the file size wouldn't change
+but its mtime would, and every other edbrowse would read the whole file again.
+The OS drops the lock when a process dies, so a stale lock can't happen,
+and we don't have to guess how old is too old.
+We don't wait forever though; if another process holds the lock
+for more than a second, it is probably suspended, and we go without the cache.
+Within this process, the entries in memory are shared by all the threads,
+so inside_mex is held from setLock() to clearLock().
+flock belongs to the open file, not the thread,
+so the mutex is also what keeps two threads from sharing one lock.
 As I write this, www.planes.com is a good test. It fetches a dozen scripts.
 Run with jsbg+ and db3 and timers-
 The first fetch spins off the threads, grabs the scripts,
@@ -2259,11 +2645,9 @@ and puts most of them in the cache.
 Unbrowse and browse, and note that these scripts now come from the cache. Nice.
 *********************************************************************/
 
-static bool setLock(void)
+static bool setLock(bool exclusive)
 {
 	int i;
-	int lock_fh;
-	time_t lock_t;
 
 	if (!cacheDir)
 		return false;
@@ -2271,54 +2655,43 @@ static bool setLock(void)
 		return false;
 
 	pthread_mutex_lock(&inside_mex);
-top:
 	time(&now_t);
 
+	if (lock_fh < 0) {
+		lock_fh = open(cacheLock, O_RDWR | O_CREAT | O_CLOEXEC, MODE_private);
+		if (lock_fh < 0)
+			goto fail;
+	}
+
 /* try every 10 ms, 100 times, for a total of 1 second */
 	for (i = 0; i < 100; ++i) {
-		lock_fh =
-		    open(cacheLock, O_WRONLY | O_EXCL | O_CREAT | O_CLOEXEC, MODE_private);
-		if (lock_fh >= 0) {	/* got it */
-			close(lock_fh);
-			if (control_fh < 0) {
-				control_fh =     open(cacheControl, O_RDWR | O_BINARY | O_CLOEXEC, 0);
-				if (control_fh < 0) {
-// got the lock but couldn't open the database
-					unlink(cacheLock);
-					pthread_mutex_unlock(&inside_mex);
-					return false;
-				}
-			}
-			if (!readControl()) {
-				unlink(cacheLock);
-				pthread_mutex_unlock(&inside_mex);
-				return false;
-			}
-			pthread_mutex_unlock(&inside_mex);
-			return true;
-		}
-		if (errno != EEXIST) {
-			pthread_mutex_unlock(&inside_mex);
-			return false;
-		}
+		if (!flock(lock_fh, (exclusive ? LOCK_EX : LOCK_SH) | LOCK_NB))
+			break;
+		if (errno != EWOULDBLOCK && errno != EINTR)
+			goto fail;
 		USLEEP(10000);
 	}
+	if (i == 100) {
+		debugPrint(3, "cache is locked");
+		goto fail;
+	}
 
-/* if lock file is more than 5 minutes old then something bad has happened,
- * just remove it. */
-	lock_t = fileTimeByName(cacheLock);
-	if (now_t - lock_t > 5 * 60) {
-		if (unlink(cacheLock) == 0)
-			goto top;
+	if (!refreshControl()) {
+// got the lock but couldn't open or read the database
+		flock(lock_fh, LOCK_UN);
+		goto fail;
 	}
+	return true;
 
+fail:
 	pthread_mutex_unlock(&inside_mex);
 	return false;
 }
 
 static void clearLock(void)
 {
-	unlink(cacheLock);
+	flock(lock_fh, LOCK_UN);
+	pthread_mutex_unlock(&inside_mex);
 }
 
 /* Remove any cached files and initialize the database */
@@ -2332,23 +2705,21 @@ static void clearCacheInternal(void)
 /* loop through and remove the files */
 	e = entries;
 	for (i = 0; i < numentries; ++i, ++e) {
-		sprintf(cacheFile, "%s/%05d", cacheDir, e->filenumber);
+		sprintf(cacheFile, "%s/%s", cacheDir, e->file);
 		unlink(cacheFile);
 	}
 
 	truncate0(cacheControl, -1);
+	freeEntries();
 }
 
 // This function is not used and has not been tested.
 // Maybe some day it will be invoked from an edbrowse command.
 void clearCache(void)
 {
-	if (!setLock())
+	if (!setLock(true))
 		return;
-	close(control_fh);
-	control_fh = -1;
 	clearCacheInternal();
-	free(cache_data);
 	clearLock();
 }
 
@@ -2368,46 +2739,43 @@ bool fetchCache(const char *url, const char *etag, time_t modtime, bool grab,
 		char **data, int *data_len)
 {
 	struct CENTRY *e;
-	int i;
-	char *newrec;
-	size_t newlen = 0;
 
 // you have to give me enough information
 	if (!grab && !modtime && (!etag || !*etag))
 		return false;
 
-	if (!setLock())
+	if (!setLock(false))
 		return false;
 
 // find the url
-	e = entries;
-	for (i = 0; i < numentries; ++i, ++e) {
-		if (!sameURL(url, e->url))
-			continue;
-		if(grab) goto match;
+	e = cacheFind(url);
+	if (!e)
+		goto nomatch;
+	if(grab) goto match;
 // look for match on etag
-		if (e->etag[0] && etag && etag[0]) {
+	if (e->etag[0] && etag && etag[0]) {
 /* both etags are present */
-			if (stringEqual(etag, e->etag))
-				goto match;
-			goto nomatch;
-		}
-		if (!modtime)
-			goto nomatch;
-		if (modtime / 8 > e->modtime)
-			goto nomatch;
-		goto match;
+		if (stringEqual(etag, e->etag))
+			goto match;
+		goto nomatch;
 	}
-// url not found
+	if (!modtime)
+		goto nomatch;
+	if (modtime / 8 > e->modtime)
+		goto nomatch;
+	goto match;
 
 nomatch:
-	free(cache_data);
 	clearLock();
 	return false;
 
 match:
-	sprintf(cacheFile, "%s/%05d", cacheDir, e->filenumber);
-	if (data_len) {
+	sprintf(cacheFile, "%s/%s", cacheDir, e->file);
+	if (e->file[0] == 'z') {
+// compressed, the caller can't read the file directly
+		if (!data_len || !zipIntoMemory(cacheFile, data, data_len))
+			goto nomatch;
+	} else if (data_len) {
 		if (!fileIntoMemory(cacheFile, data, data_len, 0))
 			goto nomatch;
 	} else {
@@ -2417,32 +2785,90 @@ match:
 	}
 
 /* file has been pulled from cache */
-/* have to update the access time */
-	e->accesstime = now_t / 8;
-	newrec = record2string(e);
-	newlen = strlen(newrec);
-	if (newlen == e->textlength) {
-		lseek(control_fh, e->offset, 0);
-		if(write(control_fh, newrec, newlen) < (int)newlen)
-			debugPrint(2, "cache cannot write %d bytes", newlen);
-	} else {
-		if (!writeControl())
-			clearCacheInternal();
-	}
+/* have to update the access time, which is written later, by a writer */
+	if (e->accesstime != now_t / 8)
+		e->accesstime = now_t / 8, e->touched = true;
 
 	debugPrint(3, "from cache");
-	free(newrec);
-	free(cache_data);
 	clearLock();
 	return true;
 }
 
+/*********************************************************************
+The cache is full, by count or by size.
+Throw out entries, least recently used first, but weighted by size,
+so one big stale file goes before a dozen little ones.
+The score is idle time times pages.
+Go until we are 100 files under the count, or 10% under the size,
+whichever was exceeded.
+A compressed file can be shared by several urls; it counts once toward
+the size, and is removed when the last entry that uses it is gone.
+Returns the number of entries removed.
+*********************************************************************/
+
 /* for quicksort */
-/* records sorted by access time in reverse order */
+/* records sorted by score, highest first */
 static int entry_cmp(const void *s, const void *t)
 {
-	return ((struct CENTRY *)t)->accesstime -
-	    ((struct CENTRY *)s)->accesstime;
+	const struct CENTRY *e1 = s, *e2 = t;
+	int now8 = now_t / 8;
+	long long score1 = (long long)(now8 - e1->accesstime + 1) * (e1->pages + 1);
+	long long score2 = (long long)(now8 - e2->accesstime + 1) * (e2->pages + 1);
+	return (score1 < score2) - (score1 > score2);
+}
+
+/* records sorted by file name, through pointers */
+static int file_cmp(const void *s, const void *t)
+{
+	return strcmp((*(struct CENTRY **)s)->file, (*(struct CENTRY **)t)->file);
+}
+
+static int pruneCache(void)
+{
+	struct CENTRY **byfile;
+	struct CENTRY *e;
+	int *refs;
+	int i, j, n = numentries;
+	int pages = 0, pagelimit = cacheSize * 256;
+	int count_target, page_target;
+
+	qsort(entries, n, sizeof(struct CENTRY), entry_cmp);
+	byfile = allocMem(n * sizeof(struct CENTRY *));
+	for (i = 0; i < n; ++i)
+		byfile[i] = entries + i;
+	qsort(byfile, n, sizeof(struct CENTRY *), file_cmp);
+	refs = allocMem(n * sizeof(int));
+	for (i = 0; i < n; i = j) {
+		for (j = i; j < n && stringEqual(byfile[j]->file, byfile[i]->file); ++j)
+			byfile[j]->group = i;
+		refs[i] = j - i;
+		pages += byfile[i]->pages;
+	}
+	free(byfile);
+
+	count_target = (n >= cacheCount ? cacheCount - 100 : n);
+	page_target = (pages >= pagelimit ? pagelimit - pagelimit / 10 : pages);
+	for (i = 0, e = entries; i < n; ++i, ++e) {
+		if (n - i <= count_target && pages <= page_target)
+			break;
+		if (!--refs[e->group]) {
+			sprintf(cacheFile, "%s/%s", cacheDir, e->file);
+			unlink(cacheFile);
+			pages -= e->pages;
+		}
+		nzFree(e->url);
+		nzFree(e->file);
+		nzFree(e->etag);
+	}
+	free(refs);
+
+	if (i) {
+		debugPrint(3, "cache is full; removing %d files", i);
+		memmove(entries, entries + i, (n - i) * sizeof(struct CENTRY));
+		numentries = n - i;
+	}
+	cacheHashBuild();
+	return i;
 }
 
 /*
@@ -2451,31 +2877,21 @@ static int entry_cmp(const void *s, const void *t)
  */
 bool presentInCache(const char *url, bool *recent)
 {
-	bool ret = false;
 	struct CENTRY *e;
-	int i;
 
-	if (!setLock())
+	if (!setLock(false))
 		return false;
 
-	e = entries;
-	for (i = 0; i < numentries; ++i, ++e) {
-		if (!sameURL(url, e->url))
-			continue;
-		ret = true;
-		break;
-	}
-
-	free(cache_data);
-	clearLock();
-	if(ret) {
+	e = cacheFind(url);
+	if(e) {
 		time(&now_t);
 		int j = now_t / 8;
 // accessed within the past 5 minutes? If so then perhaps
 // We don't have to issue the head request across the internet.
 		*recent = (j - e->accesstime <= 40);
 	}
-	return ret;
+	clearLock();
+	return !!e;
 }
 
 /* Put a file into the cache.
@@ -2487,11 +2903,17 @@ void storeCache(const char *url, const char *etag, time_t modtime,
 {
 	struct CENTRY *e;
 	int i;
-	int filenum;
-	bool append = false;
+	char name[80];
+	int pages = (datalen + 4095) / 4096;
+	bool pruned = false, rc;
 
-	if (!setLock())
+	if (!setLock(true))
 		return;
+	if (!writeTouched()) {
+		clearCacheInternal();
+		clearLock();
+		return;
+	}
 
 /* leading http:// is the default, and not needed in the control file.
  * sameURL() takes care of all that. */
@@ -2499,112 +2921,242 @@ void storeCache(const char *url, const char *etag, time_t modtime,
 		url += 7;
 
 /* find the url */
-	e = entries;
-	for (i = 0; i < numentries; ++i, ++e) {
-		if (sameURL(url, e->url))
-			break;
-	}
-
-	if (i < numentries)
-		filenum = e->filenumber;
-	else
-		filenum = generateFileNumber();
-	sprintf(cacheFile, "%s/%05d", cacheDir, filenum);
-	if (!memoryOutToFile(cacheFile, data, datalen)) {
+	e = cacheFind(url);
+
+	if (cacheZip) {
+		struct stat st;
+		zipFileName(data, datalen, name);
+		sprintf(cacheFile, "%s/%s", cacheDir, name);
+		if (stat(cacheFile, &st)) {
+			if (!zipOutToFile(cacheFile, data, datalen))
+				goto fail;
+			stat(cacheFile, &st);
+		} else
+			debugPrint(4, "cache shares %s", name);
+		pages = (st.st_size + 4095) / 4096;
+	} else {
+		if (e && e->file[0] != 'z')
+			strcpy(name, e->file);
+		else
+			generateFileNumber(name);
+		sprintf(cacheFile, "%s/%s", cacheDir, name);
+		if (!memoryOutToFile(cacheFile, data, datalen)) {
 // oops, can't write the file
-		unlink(cacheFile);
-		debugPrint(3, "cannot write web page into cache");
-		free(cache_data);
-		clearLock();
-		return;
+			unlink(cacheFile);
+			goto fail;
+		}
 	}
 
-	if (i < numentries) {
-		char *newrec;
-		size_t newlen;
+	if (e) {
 /* we're just updating a preexisting record */
+		if (!stringEqual(e->file, name)) {
+// the old file goes away, if nobody else is using it
+			if (!fileShared(e->file, e)) {
+				sprintf(cacheFile, "%s/%s", cacheDir, e->file);
+				unlink(cacheFile);
+			}
+			nzFree(e->file);
+			e->file = cloneString(name);
+		}
 		e->accesstime = now_t / 8;
 		e->modtime = modtime / 8;
-		e->etag = (etag ? etag : emptyString);
-		e->pages = (datalen + 4095) / 4096;
-		newrec = record2string(e);
-		newlen = strlen(newrec);
-		if (newlen == e->textlength) {
-/* record is the same length, just update it */
-			lseek(control_fh, e->offset, 0);
-			ignore = write(control_fh, newrec, newlen);
-			debugPrint(3, "into cache");
-			free(cache_data);
-			free(newrec);
-			clearLock();
-			return;
-		}
-
-/* Record has changed length, have to rewrite the whole control file */
-		e->textlength = newlen;
-		if (!writeControl())
+		setEtag(e, etag);
+		e->pages = pages;
+		if (!updateControl(e))
 			clearCacheInternal();
 		else
 			debugPrint(3, "into cache");
-		free(cache_data);
 		clearLock();
 		return;
 	}
 
 /* this file is new. See if the database is full. */
-	append = true;
 	if (numentries >= 140) {
 		int npages = 0;
 		e = entries;
 		for (i = 0; i < numentries; ++i, ++e)
 			npages += e->pages;
-
-		if (numentries == cacheCount || npages / 256 >= cacheSize) {
-/* sort to find the 100 oldest files */
-			qsort(entries, numentries, sizeof(struct CENTRY),
-			      entry_cmp);
-			debugPrint(3,
-				   "cache is full; removing the 100 oldest files");
-			e = entries + numentries - 100;
-			for (i = 0; i < 100; ++i, ++e) {
-				sprintf(cacheFile, "%s/%05d", cacheDir,
-					e->filenumber);
-				unlink(cacheFile);
-			}
-			numentries -= 100;
-			append = false;
-		}
+// shared files are counted more than once here, pruneCache sorts it out
+		if (numentries >= cacheCount || npages / 256 >= cacheSize)
+			pruned = (pruneCache() > 0);
 	}
 
-	e = entries + numentries;
-	++numentries;
-	e->url = url;
-	e->filenumber = filenum;
-	e->etag = (etag ? etag : emptyString);
+	e = newEntry(url);
+	e->file = cloneString(name);
+	setEtag(e, etag);
 	e->accesstime = now_t / 8;
 	e->modtime = modtime / 8;
-	e->pages = (datalen + 4095) / 4096;
+	e->pages = pages;
 
-	if (append) {
-/* didn't have to prune; just append this record */
-		char *newrec = record2string(e);
-		e->textlength = strlen(newrec);
-		lseek(control_fh, 0L, 2);
-		ignore = write(control_fh, newrec, e->textlength);
-		debugPrint(3, "into cache");
-		free(cache_data);
-		free(newrec);
-		clearLock();
-		return;
-	}
-
-// have to rewrite the whole control file
-	if (!writeControl())
+/* if we didn't have to prune, just append this record */
+	rc = (pruned ? writeControl() : updateControl(e));
+	if (!rc)
 		clearCacheInternal();
 	else
 		debugPrint(3, "into cache");
-	free(cache_data);
 	clearLock();
+	return;
+
+fail:
+	debugPrint(3, "cannot write web page into cache");
+	clearLock();
+}
+
+/*********************************************************************
+Compiled javascript, for scripts that come from the net.
+The big libraries, jquery and its friends, are the same from one site
+to the next, and from one visit to the next, and parsing them
+is a good part of the time it takes to bring up a page.
+So the bytecode is saved in cacheDir/js, in a file named by the sha256
+of the script text. The engine does the compiling, see jsRunData();
+these routines only store and retrieve the bytes.
+Bytecode is not portable from one build of quickjs to the next,
+so the first line of the file is a stamp from the engine,
+and if it doesn't match we compile again and write a new file.
+No lock is needed. A file is written to a temp name and renamed into place,
+and a file of this name holds the same bytes no matter who wrote it.
+Every hit touches the modification time, and the least recently used files
+are removed when there are more than JSCACHEFILES.
+These files are not in the control file, and the page cache never sees them.
+*********************************************************************/
+
+#define JSCACHEFILES 500
+static int jsCacheWrites;
+
+// Return the name of the bytecode file for this script, allocated,
+// or null if there is no cache.
+char *jsCacheFile(const char *source)
+{
+	static bool jsdir;
+	uchar md[SHA256_DIGEST_LENGTH];
+	char *file, *t;
+	int i;
+	if (!cacheDir || !cacheSize)
+		return 0;
+	file = allocMem(strlen(cacheDir) + 4 + 2 * SHA256_DIGEST_LENGTH + 2);
+	sprintf(file, "%s/js", cacheDir);
+	if (!jsdir) {
+		if (fileTypeByName(file, 0) != 'd' && mkdir(file, 0700)) {
+			free(file);
+			return 0;
+		}
+		jsdir = true;
+	}
+	SHA256((const uchar *)source, strlen(source), md);
+	t = file + strlen(file);
+	*t++ = '/';
+	for (i = 0; i < SHA256_DIGEST_LENGTH; ++i)
+		sprintf(t + 2 * i, "%02x", md[i]);
+	return file;
+}
+
+bool jsCacheFetch(const char *file, const char *stamp, char **data, int *len)
+{
+	struct stat st;
+	int fh, n, l = strlen(stamp);
+	char *buf;
+	fh = open(file, O_RDONLY | O_BINARY | O_CLOEXEC);
+	if (fh < 0)
+		return false;
+	if (fstat(fh, &st) || st.st_size <= l + 1) {
+		close(fh);
+		return false;
+	}
+	n = st.st_size;
+	buf = allocMem(n);
+	if (read(fh, buf, n) != n ||
+	    memcmp(buf, stamp, l) || buf[l] != '\n') {
+		debugPrint(4, "script cache %s is stale", file);
+		close(fh);
+		free(buf);
+		return false;
+	}
+	close(fh);
+	n -= l + 1;
+	memmove(buf, buf + l + 1, n);
+	*data = buf;
+	*len = n;
+// this is the access time
+	utimes(file, 0);
+	return true;
+}
+
+struct JSFILE {
+	time_t mtime;
+	char *name;
+};
+
+// most recent first
+static int jsfile_cmp(const void *s, const void *t)
+{
+	const struct JSFILE *a = s, *b = t;
+	return (a->mtime > b->mtime ? -1 : a->mtime < b->mtime ? 1 : 0);
+}
+
+static void jsCachePrune(const char *file)
+{
+	char *dir = cloneString(file), *path;
+	struct dirent *de;
+	DIR *df;
+	struct JSFILE *list;
+	int n = 0, room = 256, keep = JSCACHEFILES * 9 / 10, i;
+
+	*strrchr(dir, '/') = 0;
+	df = opendir(dir);
+	if (!df) {
+		free(dir);
+		return;
+	}
+	list = allocMem(room * sizeof(struct JSFILE));
+	while ((de = readdir(df))) {
+		struct stat st;
+		if (de->d_name[0] == '.')
+			continue;
+		ignore = asprintf(&path, "%s/%s", dir, de->d_name);
+		if (stat(path, &st)) {
+			free(path);
+			continue;
+		}
+		if (n == room) {
+			room *= 2;
+			list = reallocMem(list, room * sizeof(struct JSFILE));
+		}
+		list[n].mtime = st.st_mtime;
+		list[n++].name = path;
+	}
+	closedir(df);
+	if (n > JSCACHEFILES) {
+		qsort(list, n, sizeof(struct JSFILE), jsfile_cmp);
+// keep 90%, so we aren't doing this on every write
+		for (i = keep; i < n; ++i)
+			unlink(list[i].name);
+		debugPrint(3, "script cache pruned %d files", n - keep);
+	}
+	for (i = 0; i < n; ++i)
+		free(list[i].name);
+	free(list);
+	free(dir);
+}
+
+void jsCacheStore(const char *file, const char *stamp, const char *data, int len)
+{
+	char *temp;
+	int fh, l = strlen(stamp);
+	bool ok;
+	ignore = asprintf(&temp, "%s.%d", file, getpid());
+	fh = open(temp, O_CREAT | O_TRUNC | O_WRONLY | O_BINARY | O_CLOEXEC, MODE_private);
+	if (fh < 0) {
+		free(temp);
+		return;
+	}
+	ok = (write(fh, stamp, l) == l && write(fh, "\n", 1) == 1 &&
+	      write(fh, data, len) == len);
+	close(fh);
+	if (!ok || rename(temp, file))
+		unlink(temp);
+	free(temp);
+	if (++jsCacheWrites % 50 == 0)
+		jsCachePrune(file);
 }
 
 /* user password authorization for web access
@@ -3715,7 +4267,7 @@ static void ircLoad(void)
 // Sometimes we don't have to do all this free malloc stuff.
 // Current time is set, and often the log string fits right in, strcpy,
 // but not always, can't guarantee it, so just free and malloc.
-			nzFree(cw->r_map[l].text);
+			freeLineText(cw->r_map[l].text);
 			cw->r_map[l].text = (uchar*)cloneString(timestring);
 		}
 		nzFree(lines);
@@ -3730,7 +4282,7 @@ static void ircLoad(void)
 		for(j = 0; j < j2; ++j) {
 			timestring = conciseTime(stamps[j]);
 			l = cw->dol - j2 + 1 + j;
-			nzFree(cw->r_map[l].text);
+			freeLineText(cw->r_map[l].text);
 			cw->r_map[l].text = (uchar*)cloneString(timestring);
 		}
 		nzFree(lines);
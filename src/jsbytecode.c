@@ -0,0 +1,107 @@
+/*********************************************************************
+jsbytecode.c: compile shared.js and startwindow.js into quickjs bytecode.
+This runs at build time, after startwindow.c is generated,
+and writes startwinbc.c, which is compiled into edbrowse.
+The strings are about 300K of javascript, parsed once for the master window
+and once more for every frame, and that parse is most of the cost of
+bringing up a js context. Bytecode is loaded in a fraction of the time.
+Bytecode is tied to the quickjs library it was built with,
+so we compile it here, against the same library edbrowse links to.
+If the build supports deminimization, or there are bp@ or trace@ macros
+in the source, the arrays are empty and edbrowse falls back on the source,
+which has to be expanded at run time.
+*********************************************************************/
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "quickjs.h"
+
+extern const char startWindowJS[];
+extern const char deminJS[];
+extern const char sharedJS[];
+
+static FILE *outf;
+
+static bool hasMacros(const char *s)
+{
+	return strstr(s, "bp@(") || strstr(s, "trace@(");
+}
+
+static void emptyArray(const char *name)
+{
+	fprintf(outf, "const unsigned char %sBC[1] = {0};\n", name);
+	fprintf(outf, "const int %sBCLen = 0;\n\n", name);
+}
+
+static int compileArray(JSContext * cx, const char *name,
+			const char *source, const char *filename)
+{
+	JSValue f;
+	uint8_t *bc;
+	size_t len, i;
+
+	if (strlen(deminJS) > 5000 || hasMacros(source)) {
+		emptyArray(name);
+		return 0;
+	}
+
+	f = JS_Eval(cx, source, strlen(source), filename,
+		    JS_EVAL_TYPE_GLOBAL | JS_EVAL_FLAG_COMPILE_ONLY);
+	if (JS_IsException(f)) {
+		JSValue e = JS_GetException(cx);
+		const char *msg = JS_ToCString(cx, e);
+		fprintf(stderr, "%s: %s\n", filename, msg ? msg : "syntax error");
+		JS_FreeCString(cx, msg);
+		JS_FreeValue(cx, e);
+		return 1;
+	}
+	bc = JS_WriteObject(cx, &len, f, JS_WRITE_OBJ_BYTECODE);
+	JS_FreeValue(cx, f);
+	if (!bc) {
+		fprintf(stderr, "%s: cannot write bytecode\n", filename);
+		return 1;
+	}
+
+	fprintf(outf, "/* bytecode from %s */\n", filename);
+	fprintf(outf, "const unsigned char %sBC[] = {", name);
+	for (i = 0; i < len; ++i)
+		fprintf(outf, "%s%u,", (i % 20 ? "" : "\n"), bc[i]);
+	fprintf(outf, "\n};\n");
+	fprintf(outf, "const int %sBCLen = %d;\n\n", name, (int)len);
+	js_free(cx, bc);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	JSRuntime *rt;
+	JSContext *cx;
+	int rc = 0;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: jsbytecode outfile\n");
+		exit(1);
+	}
+	outf = fopen(argv[1], "w");
+	if (!outf) {
+		fprintf(stderr, "Error: Unable to create %s file!\n", argv[1]);
+		exit(1);
+	}
+	fprintf(outf, "/* %s: this file is machine generated; */\n\n",
+		argv[1]);
+
+	rt = JS_NewRuntime();
+	cx = JS_NewContext(rt);
+	rc |= compileArray(cx, "shared", sharedJS, "shared.js");
+	rc |= compileArray(cx, "startWindow", startWindowJS, "startwindow.js");
+	JS_FreeContext(cx);
+	JS_FreeRuntime(rt);
+
+	fclose(outf);
+	if (rc)
+		remove(argv[1]);
+	exit(rc);
+}
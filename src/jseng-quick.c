@@ -574,6 +574,34 @@ void set_property_bool_win(const Frame *f, const char *name, bool v)
 	set_property_bool(f->cx, *((JSValue*)f->winobj), name, v);
 }
 
+// Mark the text nodes that js has changed since the last render.
+// The TextNode data setter in startwindow.js lists them in dirty$text.
+void dirtyText(const Frame *f)
+{
+	JSContext *cx = f->cx;
+	JSValue d;
+	JSPropertyEnum *p_list;
+	uint32_t p_len, i;
+	d = get_property_object(cx, *((JSValue*)f->winobj), "dirty$text");
+	if(JS_IsUndefined(d))
+		return;
+	if(JS_GetOwnPropertyNames(cx, &p_list, &p_len, d, JS_GPN_STRING_MASK)) {
+		JS_Release(cx, d);
+		return;
+	}
+	for(i=0; i<p_len; ++i) {
+		const char *s = JS_AtomToCString(cx, p_list[i].atom);
+		int n = (s ? atoi(s) : 0);
+		if(n > 0 && n < cw->numTags && tagList[n]->f0 == f)
+			tagList[n]->dirty = true;
+		JS_FreeCString(cx, s);
+		JS_DeleteProperty(cx, d, p_list[i].atom, 0);
+		JS_FreeAtom(cx, p_list[i].atom);
+	}
+	js_free(cx, p_list);
+	JS_Release(cx, d);
+}
+
 void set_property_bool_doc(const Frame *f, const char *name, bool v)
 {
 	set_property_bool(f->cx, *((JSValue*)f->docobj), name, v);
@@ -1034,6 +1062,17 @@ static 	const char *bp_string =
 	  ";(function(arg$,l$ne){if(l$ne) alert('break at line ' + l$ne); while(true){var res = prompt('bp'); if(!res) continue; if(res === '.') break; try { res = eval(res); alert(res); } catch(e) { alert(e.toString()); }}}).call(this,(typeof arguments=='object'?arguments:[]),\"";
 static 	const char *trace_string =
 	  ";(function(arg$,l$ne){ var c$ne=($zct[l$ne]>=0?++$zct[l$ne]:($zct[l$ne]=1)); if(l$ne === step$go||typeof step$exp==='string'&&eval(step$exp)) step$l = 2; if(step$l == 0) return; if(step$l == 1) { alert3(l$ne+':'+c$ne); return; } if(l$ne) alert('break at line ' + l$ne+':'+c$ne); while(true){var res = prompt('bp'); if(!res) continue; if(res === '.') break; try { res = eval(res); alert(res); } catch(e) { alert(e.toString()); }}}).call(this,(typeof arguments=='object'?arguments:[]),\"";
+// Run bytecode that was compiled at build time, see jsbytecode.c.
+// Reading the bytecode is much faster than parsing the source.
+static JSValue run_bytecode(JSContext *cx, const unsigned char *bc, int len)
+{
+	JSValue f = JS_ReadObject(cx, bc, len, JS_READ_OBJ_BYTECODE);
+	if(JS_IsException(f))
+		return f;
+// this frees f
+	return JS_EvalFunction(cx, f);
+}
+
 static char *run_script(JSContext *cx, const char *s)
 {
 	char *result = 0;
@@ -1113,6 +1152,115 @@ static char *run_script(JSContext *cx, const char *s)
 	return result;
 }
 
+/*********************************************************************
+Scripts from the net are compiled once and the bytecode saved on disk,
+keyed by a hash of the text, see jsCacheFile() in isup.c.
+jquery from one site is the same as jquery from another.
+Small scripts aren't worth the trip to disk.
+Bytecode is tied to the engine, hence the stamp.
+The date this file was compiled won't do; quickjs is a separate library,
+and edbrowse can be linked against a newer one without compiling this again.
+quickjs doesn't export a version, so we compile a probe script, once,
+and the stamp is its bytecode; if the engine writes bytecode differently,
+the stamp changes and the old files are passed over.
+The first byte of bytecode is the engine's bytecode version,
+and that is checked again before JS_ReadObject.
+If the bytecode can't be read, we compile again and overwrite the file.
+*********************************************************************/
+
+#define JSCACHEMIN 4096
+static char *jsCacheStamp;
+static uint8_t jsBcVersion;
+static int jsCacheHits, jsCacheMisses;
+
+static void jsCacheProbe(JSContext *cx)
+{
+	static bool probed;
+	static const char probe[] =
+	    "(function(a,b){var c=[a,b,{x:a}];"
+	    "for(const d of c)b+=typeof d;return `${a}`+b})";
+	JSValue f;
+	uint8_t *out;
+	size_t outlen, i;
+	char *t;
+	int l;
+
+	if (probed)
+		return;
+	probed = true;
+	f = JS_Eval(cx, probe, strlen(probe), "probe",
+		    JS_EVAL_TYPE_GLOBAL | JS_EVAL_FLAG_COMPILE_ONLY);
+	if (JS_IsException(f)) {
+		JS_FreeValue(cx, JS_GetException(cx));
+		return;
+	}
+	out = JS_WriteObject(cx, &outlen, f, JS_WRITE_OBJ_BYTECODE);
+	JS_FreeValue(cx, f);
+	if (!out)
+		return;
+	if (outlen) {
+		jsBcVersion = out[0];
+		t = initString(&l);
+		stringAndString(&t, &l, "quickjs ");
+		for (i = 0; i < outlen; ++i) {
+			char hex[4];
+			sprintf(hex, "%02x", out[i]);
+			stringAndString(&t, &l, hex);
+		}
+		jsCacheStamp = t;
+	}
+	js_free(cx, out);
+}
+
+static JSValue run_cached_script(JSContext *cx, const char *s, const char *name)
+{
+	char *file, *bc;
+	int bclen;
+	uint8_t *out;
+	size_t outlen;
+	JSValue f;
+
+	jsCacheProbe(cx);
+	file = (jsCacheStamp ? jsCacheFile(s) : 0);
+	if (!file)
+		return JS_Eval(cx, s, strlen(s), name, JS_EVAL_TYPE_GLOBAL);
+
+	if (jsCacheFetch(file, jsCacheStamp, &bc, &bclen)) {
+		if (!bclen || (uint8_t)bc[0] != jsBcVersion) {
+			free(bc);
+			goto compile;
+		}
+		f = JS_ReadObject(cx, (uint8_t *) bc, bclen, JS_READ_OBJ_BYTECODE);
+		free(bc);
+		if (!JS_IsException(f)) {
+			++jsCacheHits;
+			debugPrint(3, "script cache hit, %d hits %d misses",
+				   jsCacheHits, jsCacheMisses);
+			free(file);
+// this frees f
+			return JS_EvalFunction(cx, f);
+		}
+		JS_FreeValue(cx, JS_GetException(cx));
+	}
+
+compile:
+	++jsCacheMisses;
+	debugPrint(3, "script cache miss, %d hits %d misses",
+		   jsCacheHits, jsCacheMisses);
+	f = JS_Eval(cx, s, strlen(s), name,
+		    JS_EVAL_TYPE_GLOBAL | JS_EVAL_FLAG_COMPILE_ONLY);
+	if (!JS_IsException(f)) {
+		out = JS_WriteObject(cx, &outlen, f, JS_WRITE_OBJ_BYTECODE);
+		if (out) {
+			jsCacheStore(file, jsCacheStamp, (char *)out, outlen);
+			js_free(cx, out);
+		}
+		f = JS_EvalFunction(cx, f);
+	}
+	free(file);
+	return f;
+}
+
 // execute script.text code; more efficient than the above.
 void jsRunData(const Tag *t, const char *filename, int lineno)
 {
@@ -1147,8 +1295,12 @@ void jsRunData(const Tag *t, const char *filename, int lineno)
 		char *result = run_script(cx, s);
 		nzFree(result);
 	} else {
-		JSValue r = JS_Eval(cx, s, strlen(s),
-		(jsSourceFile ? jsSourceFile : "internal"), JS_EVAL_TYPE_GLOBAL);
+		const char *name = (jsSourceFile ? jsSourceFile : "internal");
+		JSValue r;
+		if (t->js_file && !isDataURI(t->href) && strlen(s) >= JSCACHEMIN)
+			r = run_cached_script(cx, s, name);
+		else
+			r = JS_Eval(cx, s, strlen(s), name, JS_EVAL_TYPE_GLOBAL);
 		grab(r);
 		if (intFlag)
 			i_puts(MSG_Interrupted);
@@ -2789,8 +2941,7 @@ static JSValue nat_fetchHTTP(JSContext * cx, JSValueConst this, int argc, JSValu
 		JS_FreeCString(cx, incoming_headers);
 		if (cw->browseMode)
 			scriptOnTimer(t);
-		pthread_create(&t->loadthread, NULL, httpConnectBack3,
-			       (void *)t);
+		fetchQueue(t, true);
 		t->threadcreated = true;
 		return JS_NewAtomString(cx, "async");
 	}
@@ -3529,7 +3680,9 @@ JS_NewCFunction(mwc, nat_jobs, "jobspending", 0), JS_PROP_ENUMERABLE);
 // shared functions and classes
 	jsSourceFile = "shared.js";
 	jsLineno = 1;
-	if (strstr(sharedJS, "bp@(")) {
+	if(sharedBCLen) {
+		r = run_bytecode(mwc, sharedBC, sharedBCLen);
+	} else if (strstr(sharedJS, "bp@(")) {
 		const char *s, *u, *v1, *v2;
 		bool commapresent;
 		int l;
@@ -3626,20 +3779,47 @@ JS_NewCFunction(mwc, nat_jobs, "jobspending", 0), JS_PROP_ENUMERABLE);
 	js_running = true;
 }
 
-static void createJSContext_0(Frame *f)
+/*********************************************************************
+A context for a frame is the same every time, up to the end of startwindow.js.
+The native methods, the classes, the window and document objects,
+none of this depends on the web page.
+Yet it is a lot of work, and it is done for every page and every frame
+within that page, while the user waits.
+So keep a few contexts warm, built ahead of time, between commands,
+while edbrowse is waiting for input. See jsPoolFill(), called from inputLine().
+A new frame pulls a context from the pool if there is one,
+and only has to bind the things that belong to the frame:
+the context number, location, referrer, navigator, history.
+The engine itself is started for everyone, see js_main(),
+but the pool is not filled until a frame has asked for a context,
+so those who only edit files don't build contexts they will never use.
+*********************************************************************/
+
+#define JSPOOLSIZE 2
+static struct jsWarm {
+	JSContext *cx;
+	jsobjtype winobj;
+} jsPool[JSPOOLSIZE];
+static int jsPoolCount;
+static bool jsPoolWanted;	// a page has run javascript
+
+static void setup_window_1(JSContext *cx, JSValueConst w);
+
+// Build a context up to the end of startwindow.js, not yet tied to a frame.
+// The global object, which will become window, is returned in winobj.
+static JSContext *createJSContext_0(jsobjtype *winobj)
 {
 	JSContext * cx;
 	JSValue g;
 	if(!js_running)
-		return;
-	cx = f->cx = JS_NewContext(jsrt);
+		return 0;
+	cx = JS_NewContext(jsrt);
 	if (!cx)
-		return;
-	debugPrint(3, "create js context %d", f->gsn);
+		return 0;
 // the global object, which will become window,
 // and the document object.
-	f->winobj = allocMem(sizeof(JSValue));
-	*((JSValue*)f->winobj) = g = JS_GetGlobalObject(cx);
+	*winobj = allocMem(sizeof(JSValue));
+	*((JSValue*)*winobj) = g = JS_GetGlobalObject(cx);
 	grab(g);
 // link to the master window
 	JS_DefinePropertyValueStr(cx, g, "mw$", JS_GetGlobalObject(mwc), 0);
@@ -3709,12 +3889,37 @@ JS_NewCFunction(cx, nat_insbf, "insbf", 2), 0);
     JS_DefinePropertyValueStr(cx, g, "eb$rmch2",
 JS_NewCFunction(cx, nat_rmch2, "removeChild", 1), 0);
 
-// The sequence is to set f->fileName, then createContext(), so for a short time,
-// we can rely on that variable.
-// Let's make it more permanent, per context.
-// Has to be nonwritable for security reasons.
-// Could be null, e.g. an empty frame, but we can't pass null to quick.
-	JS_DefinePropertyValueStr(cx, g, "eb$ctx", JS_NewInt32(cx, f->gsn), 0);
+	setup_window_1(cx, g);
+	return cx;
+}
+
+// Called between commands; warm up one context and return true,
+// or return false if the pool is full.
+// One at a time, so we can get back to the user if input arrives.
+bool jsPoolFill(void)
+{
+	JSContext *cx;
+	jsobjtype winobj;
+	if(!jsPoolWanted || !allowJS || !js_running || jsPoolCount == JSPOOLSIZE)
+		return false;
+	cx = createJSContext_0(&winobj);
+	if(!cx)
+		return false;
+	jsPool[jsPoolCount].cx = cx;
+	jsPool[jsPoolCount].winobj = winobj;
+	++jsPoolCount;
+	debugPrint(4, "warm js contexts %d", jsPoolCount);
+	return true;
+}
+
+static void jsPoolEmpty(void)
+{
+	while(jsPoolCount) {
+		struct jsWarm *p = jsPool + --jsPoolCount;
+		JS_Release(p->cx, *((JSValue*)p->winobj));
+		free(p->winobj);
+		JS_FreeContext(p->cx);
+	}
 }
 
 static void setup_window_2(void);
@@ -3727,7 +3932,17 @@ void createJSContext(Frame *f)
 		i_puts(MSG_JSEngineRun);
 		return;
 	}
-	createJSContext_0(f);
+	jsPoolWanted = true;
+	if(jsPoolCount) {
+		struct jsWarm *p = jsPool + --jsPoolCount;
+		f->cx = p->cx;
+		f->winobj = p->winobj;
+		debugPrint(3, "warm js context %d", f->gsn);
+	} else {
+		f->cx = createJSContext_0(&f->winobj);
+		if(f->cx)
+			debugPrint(3, "create js context %d", f->gsn);
+	}
 	if (f->cx) {
 		f->jslink = true;
 		setup_window_2();
@@ -3736,6 +3951,29 @@ void createJSContext(Frame *f)
 	}
 }
 
+// the part of the setup that doesn't depend on the frame
+static void setup_window_1(JSContext *cx, JSValueConst w)
+{
+	set_property_object(cx, w, "window", w);
+
+/* the js window/document setup script.
+ * These are all the things that do not depend on the platform,
+ * OS, configurations, etc.
+ * Don't use jsRunScriptWin here; the context doesn't belong to cf,
+ * or to any frame for that matter. */
+	jsSourceFile = "startwindow.js";
+	jsLineno = 1;
+	if(startWindowBCLen) {
+		JSValue r = run_bytecode(cx, startWindowBC, startWindowBCLen);
+		if(JS_IsException(r))
+			processError(cx);
+		JS_FreeValue(cx, r);
+	} else {
+		nzFree(run_script(cx, startWindowJS));
+	}
+	jsSourceFile = 0;
+}
+
 static void setup_window_2(void)
 {
 	JSContext *cx = cf->cx;	// current context
@@ -3750,13 +3988,6 @@ static void setup_window_2(void)
 	int i;
 	char save_c;
 
-	set_property_object(cx, w, "window", w);
-
-/* the js window/document setup script.
- * These are all the things that do not depend on the platform,
- * OS, configurations, etc. */
-	jsRunScriptWin(startWindowJS, "startwindow.js", 1);
-
 	d = JS_GetPropertyStr(cx, w, "document");
 	cf->docobj = allocMem(sizeof(JSValue));
 	*((JSValue*)cf->docobj) = d;
@@ -3764,6 +3995,30 @@ static void setup_window_2(void)
 // as long as this frame exists.
 	grab(d);
 
+// The sequence is to set f->fileName, then createContext(), so for a short time,
+// we can rely on that variable.
+// Let's make it more permanent, per context.
+// Has to be nonwritable for security reasons.
+// Could be null, e.g. an empty frame, but we can't pass null to quick.
+// The context may have come from the pool, so this is set here,
+// after startwindow.js, on window and on document.
+	JS_DefinePropertyValueStr(cx, w, "eb$ctx", JS_NewInt32(cx, cf->gsn), 0);
+	JS_DefinePropertyValueStr(cx, d, "eb$ctx", JS_NewInt32(cx, cf->gsn), 0);
+// and on location, which shared.js checks before it navigates
+	{
+		JSValue wl = get_property_object(cx, w, "location");
+		JSValue dl = get_property_object(cx, d, "location");
+		if (JS_IsObject(wl))
+			JS_DefinePropertyValueStr(cx, wl, "eb$ctx", JS_NewInt32(cx, cf->gsn), 0);
+		if (JS_IsObject(dl) &&
+		    JS_VALUE_GET_PTR(dl) != JS_VALUE_GET_PTR(wl))
+			JS_DefinePropertyValueStr(cx, dl, "eb$ctx", JS_NewInt32(cx, cf->gsn), 0);
+		if (JS_IsObject(wl))
+			JS_Release(cx, wl);
+		if (JS_IsObject(dl))
+			JS_Release(cx, dl);
+	}
+
 	nav = get_property_object(cx, w, "navigator");
 	if (JS_IsUndefined(nav))
 		return;
@@ -4414,6 +4669,7 @@ void set_gcs_string(const char *name, const char *s)
 void jsClose(void)
 {
 	if(js_running) {
+		jsPoolEmpty();
 		JS_FreeContext(mwc);
 		grabover();
 // release the timer for pending jobs
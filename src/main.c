@@ -19,6 +19,7 @@ char *mailDir, *mailUnread, *mailStash, *mailReply;
 char *sigFile, *sigFileEnd;
 char *cacheDir;
 int cacheSize = 1000, cacheCount = 10000;
+bool cacheZip; // compressed cache files, shared by content
 bool hlocal; // http local, from cache only
 char *ebTempDir, *ebUserDir;
 char *userAgents[MAXAGENT + 1];
@@ -1421,7 +1422,7 @@ static const char *const keywords[] = {
 	"webtimer", "mailtimer", "certfile", "datasource", "proxy",
 	"agentsite", "localizeweb", "imapfetch", "novs", "cachesize",
 	"adbook", "envelope", "emojis", "emoji",
-"include", "js", "pubkey", "irclog", 0};
+"include", "js", "pubkey", "irclog", "cachestore", 0};
 
 /* Read the config file and populate the corresponding data structures. */
 /* This routine succeeds, or aborts via one of these macros. */
@@ -2076,6 +2077,10 @@ inside:
 			irclog = envFileAlloc(v);
 			continue;
 
+		case 51:	// cachestore
+			cacheZip = stringEqual(v, "zip");
+			continue;
+
 		default:
 			cfgLine1(MSG_EBRC_KeywordNYI, s);
 		}		/* switch */
@@ -217,7 +217,8 @@ sdm("eb$apch1", eb$apch1)
 sdm("eb$apch2", eb$apch2)
 sdm("eb$insbf", eb$insbf)
 sdm("eb$rmch2", eb$rmch2)
-sdm("eb$ctx", eb$ctx)
+// edbrowse sets eb$ctx on window and document when the context is given to a frame.
+if(window.eb$ctx) sdm("eb$ctx", eb$ctx)
 sdm("eb$seqno", 0)
 
 /* An ok (object keys) function for javascript/dom debugging.
@@ -1633,9 +1634,13 @@ TextNode.prototype.nodeType = 3;
 // setter insures data is always a string, because roving javascript might
 // node.data = 7;  ...  if(node.data.match(/x/) ...
 // and boom! It blows up because Number doesn't have a match function.
+// The setter also notes the change, by tag number, in dirty$text,
+// so edbrowse only has to query the text nodes that have changed
+// when it renders the page again. See dirtyText() in jseng-quick.c.
+swm("dirty$text", {})
 Object.defineProperty(TextNode.prototype, "data", {
 get: function() { return this.data$2; },
-set: function(s) { this.data$2 = s + ""; }});
+set: function(s) { this.data$2 = s + ""; if(this.eb$seqno) dirty$text[this.eb$seqno] = true; }});
 
 sdm2("createTextNode", function(t) {
 if(t == undefined) t = "";
@@ -2566,8 +2571,7 @@ this.location$2.href = h;
     location.replace = document.location.replace = function(s) { this.href = s};
 Object.defineProperty(window.location,'replace',{enumerable:false});
 Object.defineProperty(document.location,'replace',{enumerable:false});
-Object.defineProperty(window.location,'eb$ctx',{value:eb$ctx});
-Object.defineProperty(document.location,'eb$ctx',{value:eb$ctx});
+// location.eb$ctx is set by edbrowse, with window.eb$ctx, when the context is given to a frame.
 
 // Window constructor, passes the url back to edbrowse
 // so it can open a new web page.